@@ -4,21 +4,89 @@
 #include <linux/fs.h>           /* libfs stuff           */
 #include <linux/buffer_head.h>  /* buffer_head           */
 #include <linux/slab.h>         /* kmem_cache            */
+#include <linux/falloc.h>       /* FALLOC_FL_*           */
+#include <linux/uaccess.h>      /* clear_user            */
+#include <linux/hashtable.h>    /* DEFINE_HASHTABLE      */
+#include <linux/rculist.h>      /* hlist_*_rcu           */
+#include <linux/shrinker.h>     /* register_shrinker     */
+#include <linux/dcache.h>       /* full_name_hash        */
+#include <linux/parser.h>       /* match_token           */
+#include <linux/seq_file.h>     /* seq_puts              */
+#include <linux/blkdev.h>       /* sb_issue_discard      */
+#include <linux/workqueue.h>    /* delayed_work          */
+#include <linux/debugfs.h>      /* debugfs_create_file   */
 #include "assoofs.h"
 
 /*
 * Variables globales
 */
 static struct kmem_cache *assoofs_inode_cache;
+static struct dentry *assoofs_debugfs_root; //assoofs/ en debugfs, un directorio por volumen
 static DEFINE_MUTEX(assoofs_sb_lock); //Semaforo mutex para el superbloque
 static DEFINE_MUTEX(assoofs_inodes_lock); //Semaforo mutex para los inodos
 static DEFINE_MUTEX(assoofs_directory_children_update_lock); //Semaforo mutex para actualizar los directorios
+static DEFINE_MUTEX(assoofs_usage_lock); //Semaforo mutex para los resumenes de uso de los directorios
+
+#define ASSOOFS_ICACHE_SLOTS 64 //Tantos como bits tiene icache_valid
+
+/*
+* Fichero con datos escritos que aun no tienen bloque (asignacion retrasada)
+*/
+struct assoofs_pending_inode {
+    struct assoofs_inode_info *info; //Informacion del inodo en memoria que hay que actualizar al asignar
+    char *data; //Contenido del fichero, un bloque
+};
+
+/*
+* Informacion del superbloque en memoria. La parte persistente va la primera, asi
+* sb->s_fs_info se sigue pudiendo usar como struct assoofs_super_block_info.
+*/
+struct assoofs_sb_info {
+    struct assoofs_super_block_info disk;
+    struct super_block *sb;
+    unsigned long mount_opts;
+    uint64_t discard_pending; //Bloques liberados que aun no se han descartado en el dispositivo
+    uint64_t discard_busy; //Bloques libres que se estan descartando: no se pueden dar hasta que acabe
+    struct delayed_work discard_work;
+    spinlock_t icache_lock;
+    uint64_t icache_valid; //Bit n-1 si icache tiene al dia el inodo n
+    struct assoofs_inode_info icache[ASSOOFS_ICACHE_SLOTS]; //Copia en memoria del almacen de inodos
+    struct mutex delalloc_lock;
+    uint64_t reserved_blocks; //Bloques prometidos a ficheros con datos pendientes de escribir
+    struct assoofs_pending_inode pending[ASSOOFS_ICACHE_SLOTS]; //El inodo n en la posicion n-1
+    struct delayed_work writeback_work;
+    uint64_t lazy_dirty; //Inodos con fechas o accesos cambiados en icache que aun no estan en disco
+    struct delayed_work dirtytime_work;
+    int preload; //ASSOOFS_PRELOAD_*
+    struct work_struct preload_work;
+    struct dentry *debugfs_dir;
+};
+
+#define ASSOOFS_MOUNT_DISCARD 0x1
+enum { ASSOOFS_PRELOAD_NONE, ASSOOFS_PRELOAD_ROOT, ASSOOFS_PRELOAD_ALL }; //Opcion preload=
+#define ASSOOFS_DISCARD_DELAY (5 * HZ) //Tiempo que se acumulan bloques liberados antes de descartarlos
+#define ASSOOFS_WRITEBACK_DELAY (5 * HZ) //Tiempo que pasan los datos en memoria antes de darles bloque
+#define ASSOOFS_DIRTYTIME_DELAY (12 * 60 * 60 * HZ) //Fechas sin escribir como mucho, igual que lazytime
+#define ASSOOFS_HOT_ACCESSES 64 //Lecturas a partir de las que un fichero es caliente
+#define ASSOOFS_HOT_BLOCKS 16 //Tamaño de la zona caliente: los primeros bloques de datos, junto al almacen de inodos
+
+static inline struct assoofs_sb_info *ASSOOFS_SB(struct super_block *sb) {
+    return (struct assoofs_sb_info *)sb->s_fs_info;
+}
 /*
 * Funciones auxiliares
 */
 struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no);
 static struct inode *assoofs_get_inode(struct super_block *sb, int ino);
 int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block);
+int assoofs_alloc_zeroed_block(struct super_block *sb, uint64_t *block);
+void assoofs_sb_release_block(struct super_block *sb, uint64_t block);
+static uint64_t assoofs_discard_runs(struct super_block *sb, uint64_t blocks, uint64_t minlen);
+static uint64_t assoofs_free_now(struct super_block *sb);
+static uint64_t assoofs_discard_begin(struct super_block *sb, uint64_t mask);
+static void assoofs_discard_end(struct super_block *sb, uint64_t blocks);
+static long assoofs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+int assoofs_unshare_block(struct super_block *sb, struct assoofs_inode_info *inode_info);
 void assoofs_save_sb_info(struct super_block *vsb);
 void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode);
 int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info);
@@ -26,15 +94,55 @@ static int assoofs_create_object(struct inode *dir , struct dentry *dentry, umod
 struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *actual, struct
 assoofs_inode_info *search);
 void assoofs_destroy_inode(struct inode *inode);
+static struct assoofs_dir_bloom *assoofs_dir_bloom_of(struct buffer_head *bh);
+static void assoofs_dir_bloom_rebuild(struct assoofs_dir_bloom *bloom, struct assoofs_dir_record_entry *record, uint64_t count);
+static int assoofs_is_compact(struct super_block *sb);
+static struct buffer_head *assoofs_compact_bread(struct super_block *sb, struct assoofs_inode_info *inode_info, char **data);
+static int assoofs_compact_iterate(struct file *filp, struct dir_context *ctx, uint64_t *children);
+static struct dentry *assoofs_compact_lookup(struct inode *parent_inode, struct dentry *child_dentry);
+static int assoofs_dcache_lookup(struct super_block *sb, uint64_t dir_ino, const char *name, unsigned int len, uint64_t *inode_no);
+static void assoofs_dcache_fill(struct super_block *sb, struct assoofs_inode_info *dir_info);
+static void assoofs_dcache_add(struct super_block *sb, uint64_t dir_ino, const char *name, uint64_t inode_no, umode_t mode);
+static void assoofs_dcache_remove(struct super_block *sb, uint64_t dir_ino, const char *name);
+static int assoofs_dcache_iterate(struct super_block *sb, struct assoofs_inode_info *dir_info, struct dir_context *ctx, uint64_t *children);
+static void assoofs_dcache_drop_sb(struct super_block *sb);
+static void assoofs_dcache_forget(struct super_block *sb, uint64_t dir_ino);
+static uint64_t assoofs_ino_bit(uint64_t inode_no);
+static int assoofs_icache_get(struct super_block *sb, uint64_t inode_no, struct assoofs_inode_info *inode_info);
+static void assoofs_icache_store(struct super_block *sb, struct assoofs_inode_info *inode_info);
+static void assoofs_icache_prefetch(struct super_block *sb, uint64_t wanted);
+static int assoofs_delalloc_read(struct super_block *sb, struct assoofs_inode_info *inode_info, char __user *buf, size_t len, loff_t pos);
+static int assoofs_delalloc_write(struct super_block *sb, struct assoofs_inode_info *inode_info, const char __user *buf, size_t len, loff_t pos, int *reserved);
+static void assoofs_delalloc_flush(struct super_block *sb, uint64_t wanted);
+static void assoofs_delalloc_drop(struct super_block *sb, uint64_t inode_no);
+static void assoofs_info_to_times(struct inode *inode, struct assoofs_inode_info *inode_info);
+static void assoofs_times_to_info(struct inode *inode, struct assoofs_inode_info *inode_info);
+static int assoofs_lazy_apply(struct super_block *sb, struct assoofs_inode_info *store);
+static void assoofs_lazy_flush(struct super_block *sb);
+static void assoofs_lazy_update(struct super_block *sb, struct assoofs_inode_info *inode_info);
+static uint64_t assoofs_hot_zone(void);
+static int assoofs_is_hot(struct assoofs_inode_info *inode_info);
+static void assoofs_heat_sample(struct super_block *sb, struct assoofs_inode_info *inode_info);
+static void assoofs_heat_place(struct super_block *sb, struct assoofs_inode_info *inode_info);
+static struct assoofs_dir_usage *assoofs_dir_usage_of(struct buffer_head *bh);
+static uint64_t assoofs_usage_blocks(struct super_block *sb, struct assoofs_inode_info *inode_info);
+static void assoofs_usage_charge(struct dentry *dentry, int64_t bytes, int64_t blocks, int64_t files, int64_t dirs);
 
 /*
  *  Operaciones sobre ficheros
  */
 ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos);
 ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos);
+static long assoofs_fallocate(struct file *filp, int mode, loff_t offset, loff_t len);
+static loff_t assoofs_remap_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, loff_t len, unsigned int remap_flags);
+static int assoofs_fsync(struct file *filp, loff_t start, loff_t end, int datasync);
 const struct file_operations assoofs_file_operations = {
     .read = assoofs_read,
     .write = assoofs_write,
+    .fallocate = assoofs_fallocate,
+    .remap_file_range = assoofs_remap_file_range,
+    .unlocked_ioctl = assoofs_ioctl,
+    .fsync = assoofs_fsync,
 };
 
 /*
@@ -43,29 +151,51 @@ const struct file_operations assoofs_file_operations = {
 ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t * ppos) {
     
     struct assoofs_inode_info *inode_info;
+    struct super_block *sb;
     struct buffer_head *bh;
     char *buffer;
     int nbytes;
 
     printk(KERN_INFO "Read request\n");
 
+    sb = filp->f_path.dentry->d_inode->i_sb;
+
     inode_info = (struct assoofs_inode_info*) filp->f_path.dentry->d_inode->i_private;
 
     if(*ppos >= inode_info->file_size) return 0;
+
+    nbytes = min( (size_t)(inode_info->file_size - *ppos), len ); //Minimo entre lo que queda del fichero y lo que haya dicho el usuario
+
+    //Un fichero sin bloque se lee de memoria si tiene datos pendientes y si no (hueco) como ceros
+    if(!assoofs_is_compact(sb) && inode_info->data_block_number == ASSOOFS_NO_BLOCK) {
+        int ret = assoofs_delalloc_read(sb, inode_info, buf, nbytes, *ppos);
+        if(ret < 0)
+            return ret;
+        if(ret == 0) {
+            *ppos += nbytes;
+            file_accessed(filp);
+            assoofs_heat_sample(sb, inode_info);
+            return nbytes;
+        }
+        //Se acaba de volcar: se lee ya de su bloque
+    }
     
     //Acceder al contenido del fichero
-    bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
+    if(assoofs_is_compact(sb)) {
+        bh = assoofs_compact_bread(sb, inode_info, &buffer);
+    } else {
+        bh = sb_bread(sb, inode_info->data_block_number);
+        buffer = bh ? (char *)bh->b_data : NULL;
+    }
 
     if(!bh) {
         printk(KERN_ERR "El intento de leer el bloque numero [%llu] fallo. \n", inode_info->data_block_number);
         return 0;
     }
 
-    buffer = (char *)bh->b_data;
+    buffer += *ppos;
 
     //Copiar en buf buffer el contenido del fichero leido
-    nbytes = min( (size_t)inode_info->file_size, len ); //Minimo entre el tamaño del fichero y lo que haya dicho el usuario
-    
     if(copy_to_user(buf, buffer, nbytes)){ //Dir destino, direccion origen, cantidad de bytes
         
         brelse(bh);
@@ -75,27 +205,57 @@ ssize_t assoofs_read(struct file * filp, char __user * buf, size_t len, loff_t *
     
     *ppos += nbytes;
     brelse(bh);
+    file_accessed(filp); //atime segun relatime/noatime; solo se apunta en memoria
+    assoofs_heat_sample(sb, inode_info);
     printk(KERN_INFO "Read request completed correctly \n");
     
     return nbytes;
 }
 
-ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos) {
+static ssize_t assoofs_write_locked(struct file * filp, const char __user * buf, size_t len, loff_t * ppos) {
     
     struct assoofs_inode_info *inode_info;
     struct buffer_head *bh;
     struct super_block *sb;
 
     char *buffer;
+    uint64_t old_size;
+    int ret, reserved = 0;
     
     printk(KERN_INFO "Write request\n");
 
     sb = filp->f_path.dentry->d_inode->i_sb;
     inode_info = (struct assoofs_inode_info*) filp->f_path.dentry->d_inode->i_private;
 
+    //mtime y ctime llegan a disco con el nuevo tamaño
+    ret = file_update_time(filp);
+    if(ret) return ret;
+
+    //Un fichero sin bloque se escribe en memoria; el bloque se le da mas tarde, al volcarlo
+    if(inode_info->data_block_number == ASSOOFS_NO_BLOCK) {
+        ret = assoofs_delalloc_write(sb, inode_info, buf, len, *ppos, &reserved);
+        if(ret < 0) return ret;
+        if(ret == 0) goto update_size;
+        //Se acaba de volcar: se escribe ya en su bloque
+    }
+
+    //Si el bloque se comparte con un clon, se escribe sobre una copia propia
+    if(assoofs_unshare_block(sb, inode_info)) {
+        printk(KERN_ERR "No hay bloques libres para copiar el bloque compartido\n");
+        return -ENOSPC;
+    }
+    assoofs_heat_place(sb, inode_info);
+
+    if(*ppos + len > ASSOOFS_DEFAULT_BLOCK_SIZE)
+        return -EFBIG;
+
     //Acceder al contenido del fichero
     bh = sb_bread(sb, inode_info->data_block_number);
 
+    //Lo que quedo en el bloque tras el final del fichero no puede aparecer en el hueco
+    if(*ppos > inode_info->file_size)
+        memset(bh->b_data + inode_info->file_size, 0, *ppos - inode_info->file_size);
+
     buffer = (char *)bh->b_data;
     buffer +=*ppos;
 
@@ -106,19 +266,21 @@ ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, l
 		return -1;
 	}
 
-    *ppos += len;
-
-
     mark_buffer_dirty(bh);
     sync_dirty_buffer(bh);
     brelse(bh);
 
+update_size:
+    *ppos += len;
+
     if (mutex_lock_interruptible(&assoofs_inodes_lock)) {
 		printk(KERN_ERR "No se pudo bloquear el mutex\n");
 		return -1;
 	}
+    old_size = inode_info->file_size;
     inode_info->file_size = *ppos;
     assoofs_save_inode_info(sb, inode_info);
+    assoofs_usage_charge(filp->f_path.dentry, (int64_t)inode_info->file_size - old_size, reserved, 0, 0);
 
     mutex_unlock(&assoofs_inodes_lock);
     printk(KERN_INFO "Write request completed correctly \n");
@@ -126,6 +288,364 @@ ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, l
 	return len;
 }
 
+ssize_t assoofs_write(struct file * filp, const char __user * buf, size_t len, loff_t * ppos) {
+
+    struct inode *inode = file_inode(filp);
+    ssize_t ret;
+
+    //Con el inodo bloqueado un clon no puede compartir el bloque entre el unshare y la escritura
+    inode_lock(inode);
+    ret = assoofs_write_locked(filp, buf, len, ppos);
+    inode_unlock(inode);
+    return ret;
+}
+
+/*
+* Reserva espacio (los rangos reservados se leen como ceros) o hace huecos en un fichero.
+* Como cada fichero ocupa un unico bloque, un hueco que cubre todo el contenido libera el bloque.
+*/
+static long assoofs_fallocate_locked(struct file *filp, int mode, loff_t offset, loff_t len) {
+
+    struct inode *inode;
+    struct super_block *sb;
+    struct assoofs_inode_info *inode_info;
+    struct buffer_head *bh;
+    loff_t end, zero_start, zero_end;
+    uint64_t old_size, old_blocks;
+    long ret = 0;
+
+    printk(KERN_INFO "Fallocate request\n");
+
+    inode = file_inode(filp);
+    sb = inode->i_sb;
+    inode_info = (struct assoofs_inode_info*) inode->i_private;
+    end = offset + len;
+
+    if(mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+        return -EOPNOTSUPP;
+
+    if(end > ASSOOFS_DEFAULT_BLOCK_SIZE)
+        return -EFBIG;
+
+    assoofs_delalloc_flush(sb, assoofs_ino_bit(inode_info->inode_no)); //Los datos pendientes necesitan ya su bloque
+
+    ret = file_update_time(filp);
+    if(ret) return ret;
+
+    if (mutex_lock_interruptible(&assoofs_inodes_lock)) {
+		printk(KERN_ERR "No se pudo bloquear el mutex\n");
+		return -EINTR;
+	}
+
+    old_size = inode_info->file_size;
+    old_blocks = inode_info->data_block_number != ASSOOFS_NO_BLOCK;
+
+    if(mode & FALLOC_FL_PUNCH_HOLE) {
+        //Lo que hay despues del final del fichero no importa, por lo que el rango se recorta
+        zero_start = offset;
+        zero_end = min(end, (loff_t)inode_info->file_size);
+
+        if(inode_info->data_block_number == ASSOOFS_NO_BLOCK || zero_start >= zero_end)
+            goto out;
+
+        if(zero_start == 0 && zero_end == inode_info->file_size) {
+            //El hueco cubre todo el fichero: se devuelve el bloque
+            assoofs_sb_release_block(sb, inode_info->data_block_number);
+            inode_info->data_block_number = ASSOOFS_NO_BLOCK;
+            assoofs_save_inode_info(sb, inode_info);
+            goto out;
+        }
+    } else {
+        if(inode_info->data_block_number == ASSOOFS_NO_BLOCK) {
+            //El bloque nuevo ya esta a ceros, no hace falta limpiar ningun rango
+            if(assoofs_alloc_zeroed_block(sb, &inode_info->data_block_number)) {
+                ret = -ENOSPC;
+                goto out;
+            }
+            zero_start = zero_end = 0;
+        } else {
+            //Lo que quede en el bloque detras del final del fichero no debe poder leerse
+            zero_start = inode_info->file_size;
+            zero_end = (mode & FALLOC_FL_KEEP_SIZE) ? zero_start : max(end, zero_start);
+        }
+
+        if(!(mode & FALLOC_FL_KEEP_SIZE) && end > inode_info->file_size)
+            inode_info->file_size = end;
+
+        assoofs_save_inode_info(sb, inode_info);
+    }
+
+    if(zero_start < zero_end) {
+        if(assoofs_unshare_block(sb, inode_info)) {
+            ret = -ENOSPC;
+            goto out;
+        }
+
+        bh = sb_bread(sb, inode_info->data_block_number);
+        if(!bh) {
+            printk(KERN_ERR "El intento de leer el bloque numero [%llu] fallo. \n", inode_info->data_block_number);
+            ret = -EIO;
+            goto out;
+        }
+        memset(bh->b_data + zero_start, 0, zero_end - zero_start);
+        mark_buffer_dirty(bh);
+        sync_dirty_buffer(bh);
+        brelse(bh);
+    }
+
+out:
+    assoofs_usage_charge(filp->f_path.dentry, (int64_t)inode_info->file_size - old_size,
+                         (int64_t)(inode_info->data_block_number != ASSOOFS_NO_BLOCK) - old_blocks, 0, 0);
+    mutex_unlock(&assoofs_inodes_lock);
+    printk(KERN_INFO "Fallocate request completed\n");
+    return ret;
+}
+
+static long assoofs_fallocate(struct file *filp, int mode, loff_t offset, loff_t len) {
+
+    struct inode *inode = file_inode(filp);
+    long ret;
+
+    //Igual que en assoofs_write: el bloque no puede cambiar ni soltarse a mitad de una escritura
+    inode_lock(inode);
+    ret = assoofs_fallocate_locked(filp, mode, offset, len);
+    inode_unlock(inode);
+    return ret;
+}
+
+/*
+* Clonar con el origen y el destino ya bloqueados
+*/
+static loff_t assoofs_remap_locked(struct super_block *sb, struct file *file_in, struct file *file_out, loff_t pos_in, loff_t pos_out, loff_t len, unsigned int remap_flags) {
+
+    struct assoofs_inode_info *src_info = file_inode(file_in)->i_private;
+    struct assoofs_inode_info *dst_info = file_inode(file_out)->i_private;
+    struct assoofs_super_block_info *assoofs_sb;
+    uint64_t old_block, old_size, old_blocks;
+    loff_t ret;
+
+    //Solo se clona el fichero entero; pasar del final solo vale si se puede acortar
+    if(pos_in != 0 || pos_out != 0 || (len != 0 && len < src_info->file_size))
+        return -EOPNOTSUPP;
+    if(len > src_info->file_size && !(remap_flags & REMAP_FILE_CAN_SHORTEN))
+        return -EINVAL;
+
+    assoofs_delalloc_flush(sb, assoofs_ino_bit(src_info->inode_no) | assoofs_ino_bit(dst_info->inode_no));
+
+    ret = file_update_time(file_out);
+    if(ret) return ret;
+
+    if (mutex_lock_interruptible(&assoofs_inodes_lock)) {
+		printk(KERN_ERR "No se pudo bloquear el mutex\n");
+		return -EINTR;
+	}
+
+    ret = src_info->file_size;
+    old_block = dst_info->data_block_number;
+    old_size = dst_info->file_size;
+    old_blocks = old_block != ASSOOFS_NO_BLOCK;
+
+    if(src_info->data_block_number != ASSOOFS_NO_BLOCK && src_info->data_block_number != old_block) {
+        mutex_lock(&assoofs_sb_lock);
+        assoofs_sb = sb->s_fs_info;
+        if(assoofs_sb->block_refcount[src_info->data_block_number] == U8_MAX) {
+            mutex_unlock(&assoofs_sb_lock);
+            ret = -EMLINK;
+            goto out;
+        }
+        assoofs_sb->block_refcount[src_info->data_block_number]++;
+        assoofs_save_sb_info(sb);
+        mutex_unlock(&assoofs_sb_lock);
+    } else if(src_info->data_block_number == old_block) {
+        old_block = ASSOOFS_NO_BLOCK; //Ya lo compartian, no hay que soltar nada
+    }
+
+    dst_info->data_block_number = src_info->data_block_number;
+    dst_info->file_size = src_info->file_size;
+    assoofs_save_inode_info(sb, dst_info);
+
+    assoofs_sb_release_block(sb, old_block);
+
+out:
+    assoofs_usage_charge(file_out->f_path.dentry, (int64_t)dst_info->file_size - old_size,
+                         (int64_t)(dst_info->data_block_number != ASSOOFS_NO_BLOCK) - old_blocks, 0, 0);
+    mutex_unlock(&assoofs_inodes_lock);
+    printk(KERN_INFO "Clone request completed\n");
+    return ret;
+}
+
+/*
+* Clonar un fichero (FICLONE, cp --reflink): el destino pasa a compartir el bloque del origen.
+* Los ficheros tienen un unico bloque, asi que solo se admite clonar el fichero entero.
+*/
+static loff_t assoofs_remap_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, loff_t len, unsigned int remap_flags) {
+
+    struct super_block *sb;
+    struct assoofs_inode_info *src_info;
+    struct assoofs_inode_info *dst_info;
+    loff_t ret;
+
+    printk(KERN_INFO "Clone request\n");
+
+    sb = file_inode(file_in)->i_sb;
+    src_info = (struct assoofs_inode_info*) file_inode(file_in)->i_private;
+    dst_info = (struct assoofs_inode_info*) file_inode(file_out)->i_private;
+
+    if(remap_flags & ~REMAP_FILE_CAN_SHORTEN)
+        return -EOPNOTSUPP;
+
+    if(src_info->inode_no == dst_info->inode_no)
+        return -EINVAL;
+
+    //Ninguna escritura puede tocar los bloques mientras se comparten
+    lock_two_nondirectories(file_inode(file_in), file_inode(file_out));
+
+    ret = assoofs_remap_locked(sb, file_in, file_out, pos_in, pos_out, len, remap_flags);
+
+    unlock_two_nondirectories(file_inode(file_in), file_inode(file_out));
+    return ret;
+}
+
+/*
+* FITRIM: descartar en el dispositivo los bloques libres del rango pedido
+*/
+static long assoofs_fitrim(struct super_block *sb, struct fstrim_range __user *arg) {
+
+    struct fstrim_range range;
+    uint64_t start, end, minlen, mask, trimmed;
+
+    if(!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    if(!blk_queue_discard(bdev_get_queue(sb->s_bdev)))
+        return -EOPNOTSUPP;
+    if(sb_rdonly(sb))
+        return -EROFS;
+    if(copy_from_user(&range, arg, sizeof(range)))
+        return -EFAULT;
+
+    start = DIV_ROUND_UP(range.start, ASSOOFS_DEFAULT_BLOCK_SIZE);
+    end = (range.start + min(range.len, ULLONG_MAX - range.start)) / ASSOOFS_DEFAULT_BLOCK_SIZE;
+    end = min_t(uint64_t, end, ASSOOFS_MAX_BLOCKS);
+    minlen = max_t(uint64_t, 1, DIV_ROUND_UP(range.minlen, ASSOOFS_DEFAULT_BLOCK_SIZE));
+
+    mask = 0;
+    if(start < end)
+        mask = (end == 64 ? ~0ULL : (1ULL << end) - 1) & ~((1ULL << start) - 1);
+
+    mutex_lock(&assoofs_sb_lock);
+    mask = assoofs_discard_begin(sb, mask);
+    mutex_unlock(&assoofs_sb_lock);
+
+    trimmed = assoofs_discard_runs(sb, mask, minlen); //Sin el cerrojo: se espera al dispositivo
+    assoofs_discard_end(sb, mask);
+
+    range.len = trimmed * ASSOOFS_DEFAULT_BLOCK_SIZE;
+    if(copy_to_user(arg, &range, sizeof(range)))
+        return -EFAULT;
+
+    printk(KERN_INFO "FITRIM: %llu bloques descartados\n", trimmed);
+    return 0;
+}
+
+/*
+* ASSOOFS_IOC_BULKSTAT: recorrido secuencial del almacen de inodos, sin pasar por los directorios
+*/
+static long assoofs_bulkstat(struct super_block *sb, struct assoofs_bulkstat_req __user *arg) {
+
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_bulkstat_req req;
+    struct assoofs_bulkstat *out;
+    struct assoofs_inode_info *store, info;
+    struct buffer_head *bh;
+    uint64_t i, n = 0;
+    long ret = 0;
+
+    if(!capable(CAP_SYS_ADMIN))
+        return -EPERM;
+    if(copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+
+    req.count = min_t(uint64_t, req.count, ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED);
+    out = kcalloc(max_t(uint64_t, req.count, 1), sizeof(*out), GFP_KERNEL);
+    if(!out)
+        return -ENOMEM;
+
+    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+    if(!bh) {
+        kfree(out);
+        return -EIO;
+    }
+    store = (struct assoofs_inode_info *)bh->b_data;
+
+    mutex_lock(&assoofs_sb_lock); //Que no cambie el almacen a mitad del lote
+    for(i = req.cursor; i < sbi->disk.inodes_count && n < req.count; i++) {
+        //icache tiene las fechas que aun no se han escrito
+        if(!assoofs_icache_get(sb, store[i].inode_no, &info))
+            info = store[i];
+
+        out[n].inode_no = info.inode_no;
+        out[n].mode = info.mode;
+        out[n].size = info.file_size;
+        out[n].block = info.data_block_number;
+        out[n].atime = info.atime;
+        out[n].mtime = info.mtime;
+        out[n].ctime = info.ctime;
+        n++;
+    }
+    mutex_unlock(&assoofs_sb_lock);
+    brelse(bh);
+
+    req.cursor = i;
+    req.count = n;
+    if(copy_to_user(u64_to_user_ptr(req.buffer), out, n * sizeof(*out)) || copy_to_user(arg, &req, sizeof(req)))
+        ret = -EFAULT;
+
+    kfree(out);
+    return ret;
+}
+
+/*
+* ASSOOFS_IOC_GETUSAGE: lo que ocupa el subarbol de un directorio, leido de su bloque
+*/
+static long assoofs_getusage(struct inode *inode, struct assoofs_dir_usage __user *arg) {
+
+    struct assoofs_inode_info *dir_info = inode->i_private;
+    struct assoofs_dir_usage usage;
+    struct buffer_head *bh;
+
+    if(!S_ISDIR(dir_info->mode))
+        return -ENOTDIR;
+    if(assoofs_is_compact(inode->i_sb)) //Sus directorios no tienen hueco para el resumen
+        return -EOPNOTSUPP;
+
+    bh = sb_bread(inode->i_sb, dir_info->data_block_number);
+    if(!bh)
+        return -EIO;
+
+    mutex_lock(&assoofs_usage_lock);
+    memcpy(&usage, assoofs_dir_usage_of(bh), sizeof(usage));
+    mutex_unlock(&assoofs_usage_lock);
+    brelse(bh);
+
+    if(copy_to_user(arg, &usage, sizeof(usage)))
+        return -EFAULT;
+    return 0;
+}
+
+static long assoofs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+
+    switch(cmd) {
+    case FITRIM:
+        return assoofs_fitrim(file_inode(filp)->i_sb, (struct fstrim_range __user *)arg);
+    case ASSOOFS_IOC_BULKSTAT:
+        return assoofs_bulkstat(file_inode(filp)->i_sb, (struct assoofs_bulkstat_req __user *)arg);
+    case ASSOOFS_IOC_GETUSAGE:
+        return assoofs_getusage(file_inode(filp), (struct assoofs_dir_usage __user *)arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
 /*
  *  Operaciones sobre directorios
  */
@@ -133,6 +653,7 @@ static int assoofs_iterate(struct file *filp, struct dir_context *ctx);
 const struct file_operations assoofs_dir_operations = {
     .owner = THIS_MODULE,
     .iterate = assoofs_iterate,
+    .unlocked_ioctl = assoofs_ioctl,
 };
 
 /*
@@ -145,8 +666,9 @@ static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
     struct buffer_head *bh;
     struct assoofs_dir_record_entry *record;
     struct assoofs_inode_info *inode_info;
+    uint64_t children = 0;
 
-    int i;
+    int i, ret;
 
 
     printk(KERN_INFO "Iterate request\n");
@@ -159,6 +681,17 @@ static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
 
     if((!S_ISDIR(inode_info->mode))) return -1; //Si no es un directorio salimos
 
+    //Despues de listar suele venir un stat de cada hijo (ls -l, find): se pide ya el almacen de inodos
+    sb_breadahead(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+
+    if(!assoofs_dcache_iterate(sb, inode_info, ctx, &children)) goto prefetch; //Directorio ya leido y en memoria
+
+    if(assoofs_is_compact(sb)) {
+        ret = assoofs_compact_iterate(filp, ctx, &children);
+        if(!ret) assoofs_icache_prefetch(sb, children);
+        return ret;
+    }
+
     bh = sb_bread(sb, inode_info->data_block_number); //Se lee el bloque
     record = (struct assoofs_dir_record_entry *)bh->b_data;
 
@@ -166,10 +699,14 @@ static int assoofs_iterate(struct file *filp, struct dir_context *ctx) {
 
         dir_emit(ctx, record->filename, ASSOOFS_FILENAME_MAXLEN, record->inode_no, DT_UNKNOWN); //Nombre del archivo y numero
         ctx->pos += sizeof(struct assoofs_dir_record_entry);
+        children |= assoofs_ino_bit(record->inode_no);
         record++;
     }
 
     brelse(bh);
+
+prefetch:
+    assoofs_icache_prefetch(sb, children); //Los lookup de los hijos ya no leeran el almacen
     printk(KERN_INFO "Iterated correctly\n");
     return 0;
 }
@@ -181,11 +718,13 @@ static int assoofs_create(struct inode *dir, struct dentry *dentry, umode_t mode
 struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags);
 static int assoofs_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode);
 static int assoofs_unlink(struct inode *dir,struct dentry *dentry);
+static int assoofs_update_time(struct inode *inode, struct timespec64 *time, int flags);
 static struct inode_operations assoofs_inode_ops = {
     .create = assoofs_create,
     .lookup = assoofs_lookup,
     .mkdir = assoofs_mkdir,
     .unlink = assoofs_unlink,
+    .update_time = assoofs_update_time,
 };
 
 static int assoofs_unlink(struct inode *dir, struct dentry *dentry){
@@ -193,7 +732,7 @@ static int assoofs_unlink(struct inode *dir, struct dentry *dentry){
 	uint64_t block_no = -1;
 	uint64_t inode_no = -1;
 	uint64_t last_inode_no = -1;
-	uint64_t last_block_no = -1;
+	uint64_t freed_bytes, freed_blocks;
 
 	struct super_block *sb;
 	struct buffer_head *bh;
@@ -211,10 +750,14 @@ static int assoofs_unlink(struct inode *dir, struct dentry *dentry){
 	
     printk(KERN_INFO "Peticion a eliminar un archivo.\n");
 
+	//El mismo cerrojo que create: nadie lee el directorio a medio cambiar (precarga)
+	if (mutex_lock_interruptible(&assoofs_directory_children_update_lock)) {
+		printk(KERN_ERR "No se pudo bloquear el mutex\n");
+		return -EINTR;
+	}
 
 	deleted_inode_info = (struct assoofs_inode_info *)dentry->d_inode->i_private;
 	parent_inode_info = (struct assoofs_inode_info *)dir->i_private;
-	block_no = deleted_inode_info->data_block_number;
 	inode_no = deleted_inode_info->inode_no;
 	
 	sb = dir->i_sb;
@@ -226,16 +769,30 @@ static int assoofs_unlink(struct inode *dir, struct dentry *dentry){
 	record +=parent_inode_info->dir_children_count-1; //Muevo record hasta el ultimo nodo
 	
 	last_inode_no = record->inode_no;
+
+	//Lo que deja de ocupar el fichero, antes de que sus datos pendientes desaparezcan
+	freed_bytes = deleted_inode_info->file_size;
+	freed_blocks = assoofs_usage_blocks(sb, deleted_inode_info);
+
+	assoofs_lazy_flush(sb); //Los registros van a cambiar de sitio
+
+	//Los datos pendientes del borrado se tiran sin llegar a pedir bloque. El ultimo hijo cambia
+	//de numero de inodo: si tiene datos pendientes se vuelcan antes, que se guardan por numero
+	assoofs_delalloc_drop(sb, inode_no);
+	if(last_inode_no != inode_no)
+		assoofs_delalloc_flush(sb, assoofs_ino_bit(last_inode_no));
+	block_no = deleted_inode_info->data_block_number;
+
 	new_info = assoofs_get_inode_info(sb, last_inode_no); //Saco la informacion DEL ULTIMO NODO
 	
-	last_block_no = new_info->data_block_number; //Saco el numero de bloque
+    assoofs_sb_release_block(sb, block_no); //Libero el bloque del archivo borrado
 	
-    sb_info->free_blocks |= (1 << last_block_no); //Libero el bloque del ultimo archivo del directorio
-	assoofs_save_sb_info(sb);
-	
-	new_info->inode_no = inode_no; //Le asigno el numero de inodo borrado
-	new_info->data_block_number = block_no; //Le asigno el numero de bloque del borrado
+	new_info->inode_no = inode_no; //Le asigno el numero de inodo borrado; conserva su propio bloque
 	assoofs_save_inode_info(sb, new_info);	
+
+	//Las tablas guardadas con los dos numeros ya no corresponden a quien los lleva
+	assoofs_dcache_forget(sb, inode_no);
+	assoofs_dcache_forget(sb, last_inode_no);
 	
 	assoofs_destroy_inode(assoofs_get_inode(sb,last_inode_no));
 
@@ -253,10 +810,20 @@ static int assoofs_unlink(struct inode *dir, struct dentry *dentry){
 	printk(KERN_INFO "Cambio el nombre de %s a %s",dir_contents->filename, record->filename);
     strcpy(dir_contents->filename, record->filename);
 
+	//En la cache el nombre borrado desaparece y el del ultimo hijo pasa a tener el inodo borrado
+	assoofs_dcache_remove(sb, parent_inode_info->inode_no, dentry->d_name.name);
+	if(dir_contents != record) {
+		assoofs_dcache_remove(sb, parent_inode_info->inode_no, dir_contents->filename);
+		assoofs_dcache_add(sb, parent_inode_info->inode_no, dir_contents->filename, inode_no, new_info->mode);
+	}
+
 	//Inutilizar el nodo
 	record->inode_no = -1;
 	strcpy(record->filename, "\0");
 
+	//Un filtro de Bloom no permite quitar nombres, se reconstruye con los que quedan
+	assoofs_dir_bloom_rebuild(assoofs_dir_bloom_of(bh), (struct assoofs_dir_record_entry*)bh->b_data, parent_inode_info->dir_children_count-1);
+
     //Guardar cambios en disco
     mark_buffer_dirty(bh);
     sync_dirty_buffer(bh);
@@ -264,14 +831,24 @@ static int assoofs_unlink(struct inode *dir, struct dentry *dentry){
 	
 	//Borro el ultimo hijo del padre, que es el que acabo de eliminar
 	parent_inode_info->dir_children_count--;
+	dir->i_mtime = dir->i_ctime = current_time(dir);
+	assoofs_times_to_info(dir, parent_inode_info);
     assoofs_save_inode_info(sb, parent_inode_info);
+
+	assoofs_usage_charge(dentry, -(int64_t)freed_bytes, -(int64_t)freed_blocks, -1, 0);
 	
 	//Reduzco la cuenta de nodos totales, para que se puedan volver a utilizar y los desvinculo
 	sb_info->inodes_count--;
 	assoofs_save_sb_info(sb);
 
+	//Al bajar la cuenta deja de verse el ultimo registro del almacen, se olvida la copia en memoria
+	spin_lock(&ASSOOFS_SB(sb)->icache_lock);
+	ASSOOFS_SB(sb)->icache_valid = 0;
+	spin_unlock(&ASSOOFS_SB(sb)->icache_lock);
+
 	simple_unlink(dir,dentry);
 	d_invalidate(dentry);
+	mutex_unlock(&assoofs_directory_children_update_lock);
 	
     printk(KERN_INFO "Archivo borrado correctamente");
     return 0;
@@ -296,48 +873,1184 @@ static struct inode *assoofs_get_inode(struct super_block *sb, int ino){
 	inodo->i_ino = ino; //Se asigna numero de inodo
     inodo->i_sb = sb; //Se asigna un puntero al superbloque
     inodo->i_op = &assoofs_inode_ops; //Se asignan operaciones de inodo
-    inodo->i_atime = inodo->i_mtime = inodo->i_ctime = current_time(inodo); //Se le asignan las fechas (acceso, modificacion y creacion)
+    assoofs_info_to_times(inodo, inode_info); //Las fechas guardadas (acceso, modificacion y cambio)
 	inodo->i_private = inode_info;
 	
 	return inodo;
 }
 
-struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags) {
-	
-	struct assoofs_inode_info *parent_info; 
-	struct super_block *sb; 
-	struct buffer_head *bh; 
-	struct assoofs_dir_record_entry *record;
-    struct inode *inode;
-	
-	int i;
-	
-    parent_info = parent_inode->i_private;
-    sb = parent_inode->i_sb; //Se toma el superbloque
-	bh = sb_bread(sb, parent_info->data_block_number); //Bh para leer un bloque concreto
-    
-	printk(KERN_INFO "Lookup in: ino=%llu, b=%llu\n",parent_info->inode_no, parent_info->data_block_number);
+struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags) {
+	
+	struct assoofs_inode_info *parent_info; 
+	struct super_block *sb; 
+	struct buffer_head *bh; 
+	struct assoofs_dir_record_entry *record;
+	struct assoofs_dir_bloom *bloom;
+    struct inode *inode;
+	uint64_t inode_no;
+	
+	int i;
+	
+    parent_info = parent_inode->i_private;
+    sb = parent_inode->i_sb; //Se toma el superbloque
+
+	//Primero la cache de directorios en memoria, sin tocar el dispositivo
+	switch(assoofs_dcache_lookup(sb, parent_info->inode_no, child_dentry->d_name.name, child_dentry->d_name.len, &inode_no)) {
+	case 1:
+		inode = assoofs_get_inode(sb, inode_no);
+		inode_init_owner(inode, parent_inode, ((struct assoofs_inode_info*)inode->i_private)->mode);
+		d_add(child_dentry, inode);
+		return NULL;
+	case 0:
+		d_add(child_dentry, NULL);
+		return NULL;
+	default:
+		assoofs_dcache_fill(sb, parent_info); //La proxima vez ya estara en memoria
+	}
+
+	if(assoofs_is_compact(sb)) return assoofs_compact_lookup(parent_inode, child_dentry);
+
+	bh = sb_bread(sb, parent_info->data_block_number); //Bh para leer un bloque concreto
+    
+	printk(KERN_INFO "Lookup in: ino=%llu, b=%llu\n",parent_info->inode_no, parent_info->data_block_number);
+
+	record = (struct assoofs_dir_record_entry*)bh->b_data;
+	bloom = assoofs_dir_bloom_of(bh);
+
+	//Si el filtro descarta el nombre no hace falta recorrer las entradas
+	if(!assoofs_dir_bloom_may_contain(bloom, child_dentry->d_name.name))
+		goto not_found;
+	
+	for(i = 0; i<parent_info->dir_children_count;i++){ //Recorro el bucle tantas veces como archivos tenga
+		printk(KERN_INFO "Have file: '%s' (ino=%llu)\n", record->filename, record->inode_no);
+		if(!strcmp(record->filename, child_dentry->d_name.name)){ //Se compara el nombre con el del argumento (devuelve 0 si son iguales)
+			
+			//Se guarda en memoria la información del inodo
+			inode = assoofs_get_inode(sb, record->inode_no);
+			brelse(bh);
+			
+			inode_init_owner(inode, parent_inode, ((struct assoofs_inode_info*)inode->i_private)->mode);
+			d_add(child_dentry, inode); //Para construir el arbol de inodos
+			return NULL;
+		}
+		
+		record++;
+	}
+
+not_found:
+	printk(KERN_ERR "No se encontro inodo para el nombre [%s]\n", child_dentry->d_name.name);
+    brelse(bh);
+	d_add(child_dentry, NULL); //Dentry negativo, los siguientes fallos se resuelven en la cache
+    return NULL;
+}
+
+/*
+* Filtro de Bloom de un directorio, guardado al final de su bloque de datos
+*/
+static struct assoofs_dir_bloom *assoofs_dir_bloom_of(struct buffer_head *bh) {
+    return (struct assoofs_dir_bloom *)(bh->b_data + ASSOOFS_DEFAULT_BLOCK_SIZE - sizeof(struct assoofs_dir_bloom));
+}
+
+/*
+* Rehacer el filtro de Bloom con los count primeros registros del directorio
+*/
+static void assoofs_dir_bloom_rebuild(struct assoofs_dir_bloom *bloom, struct assoofs_dir_record_entry *record, uint64_t count) {
+
+    uint64_t i;
+
+    memset(bloom->bits, 0, sizeof(bloom->bits));
+    for(i = 0; i < count; i++, record++)
+        assoofs_dir_bloom_add(bloom, record->filename);
+
+    bloom->magic = ASSOOFS_DIR_BLOOM_MAGIC; //Al final, para que nadie use un filtro a medias
+}
+
+/*
+ *  Imagenes compactas de solo lectura
+ */
+static int assoofs_is_compact(struct super_block *sb) {
+    return ((struct assoofs_super_block_info*)sb->s_fs_info)->flags & ASSOOFS_SB_FLAG_COMPACT;
+}
+
+/*
+* Leer el bloque donde empiezan los datos de un objeto de una imagen compacta.
+* En data se devuelve la posicion de los datos dentro del bloque.
+*/
+static struct buffer_head *assoofs_compact_bread(struct super_block *sb, struct assoofs_inode_info *inode_info, char **data) {
+
+    struct buffer_head *bh;
+
+    bh = sb_bread(sb, inode_info->data_byte_offset / ASSOOFS_DEFAULT_BLOCK_SIZE);
+    if(bh)
+        *data = bh->b_data + inode_info->data_byte_offset % ASSOOFS_DEFAULT_BLOCK_SIZE;
+    return bh;
+}
+
+static int assoofs_compact_iterate(struct file *filp, struct dir_context *ctx, uint64_t *children) {
+
+    struct inode *inode;
+    struct buffer_head *bh;
+    struct assoofs_inode_info *inode_info;
+    struct assoofs_compact_dir_entry *entry;
+    char *data;
+
+    int i;
+
+    inode = filp->f_path.dentry->d_inode;
+    inode_info = inode->i_private;
+
+    bh = assoofs_compact_bread(inode->i_sb, inode_info, &data);
+    if(!bh) return -EIO;
+
+    entry = (struct assoofs_compact_dir_entry *)data;
+    for(i = 0; i < inode_info->dir_children_count; i++, entry++){
+        dir_emit(ctx, data + entry->name_offset, entry->name_len, entry->inode_no, DT_UNKNOWN);
+        ctx->pos += sizeof(struct assoofs_compact_dir_entry);
+        *children |= assoofs_ino_bit(entry->inode_no);
+    }
+
+    brelse(bh);
+    printk(KERN_INFO "Iterated correctly\n");
+    return 0;
+}
+
+/*
+* Las entradas de un directorio compacto estan ordenadas: busqueda binaria
+*/
+static struct dentry *assoofs_compact_lookup(struct inode *parent_inode, struct dentry *child_dentry) {
+
+    struct assoofs_inode_info *parent_info;
+    struct buffer_head *bh;
+    struct assoofs_compact_dir_entry *entry;
+    struct inode *inode;
+    char *data;
+
+    uint64_t lo, hi, mid;
+    int cmp;
+
+    parent_info = parent_inode->i_private;
+    bh = assoofs_compact_bread(parent_inode->i_sb, parent_info, &data);
+    if(!bh) return ERR_PTR(-EIO);
+
+    entry = (struct assoofs_compact_dir_entry *)data;
+    lo = 0;
+    hi = parent_info->dir_children_count;
+
+    while(lo < hi){
+        mid = lo + (hi - lo) / 2;
+        cmp = assoofs_compact_name_cmp(child_dentry->d_name.name, child_dentry->d_name.len, data + entry[mid].name_offset, entry[mid].name_len);
+
+        if(!cmp){
+            inode = assoofs_get_inode(parent_inode->i_sb, entry[mid].inode_no);
+            brelse(bh);
+
+            inode_init_owner(inode, parent_inode, ((struct assoofs_inode_info*)inode->i_private)->mode);
+            d_add(child_dentry, inode);
+            return NULL;
+        }
+
+        if(cmp < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    brelse(bh);
+    d_add(child_dentry, NULL);
+    return NULL;
+}
+
+/*
+ *  Cache de directorios en memoria
+ *
+ *  Cada directorio consultado se convierte en una tabla nombre -> (inodo, tipo) que se
+ *  busca sin bloqueos (RCU). Las modificaciones van con assoofs_dcache_lock y las
+ *  entradas de un directorio solo cambian con su i_rwsem cogido (create y unlink).
+ */
+struct assoofs_dcache_dir {
+    struct hlist_node hash;     //En assoofs_dcache_dirs
+    struct list_head lru;       //En assoofs_dcache_lru, los mas antiguos primero
+    struct list_head entries;
+    struct super_block *sb;
+    uint64_t dir_ino;
+    unsigned long nr_entries;
+    refcount_t ref;             //Una referencia de la cache y una por cada iterate en curso
+    struct rcu_head rcu;
+};
+
+struct assoofs_dcache_entry {
+    struct hlist_node hash;     //En assoofs_dcache_names
+    struct list_head sibling;
+    struct assoofs_dcache_dir *dir;
+    uint64_t inode_no;
+    unsigned char type;
+    unsigned int name_len;
+    struct rcu_head rcu;
+    char name[];
+};
+
+static DEFINE_HASHTABLE(assoofs_dcache_dirs, 6);
+static DEFINE_HASHTABLE(assoofs_dcache_names, 8);
+static LIST_HEAD(assoofs_dcache_lru);
+static DEFINE_SPINLOCK(assoofs_dcache_lock);
+static atomic_long_t assoofs_dcache_count = ATOMIC_LONG_INIT(0);
+static unsigned long assoofs_dcache_gen; //Con assoofs_dcache_lock; cambia al olvidar un numero reutilizado
+
+static unsigned long assoofs_dcache_dir_key(struct super_block *sb, uint64_t dir_ino) {
+    return (unsigned long)sb ^ dir_ino;
+}
+
+static unsigned int assoofs_dcache_name_key(struct assoofs_dcache_dir *dir, const char *name, unsigned int len) {
+    return full_name_hash(dir, name, len);
+}
+
+/*
+* Buscar el directorio en la cache, con rcu_read_lock o assoofs_dcache_lock
+*/
+static struct assoofs_dcache_dir *assoofs_dcache_find_dir(struct super_block *sb, uint64_t dir_ino) {
+
+    struct assoofs_dcache_dir *dir;
+
+    hash_for_each_possible_rcu(assoofs_dcache_dirs, dir, hash, assoofs_dcache_dir_key(sb, dir_ino))
+        if(dir->sb == sb && dir->dir_ino == dir_ino)
+            return dir;
+    return NULL;
+}
+
+static struct assoofs_dcache_entry *assoofs_dcache_find_entry(struct assoofs_dcache_dir *dir, const char *name, unsigned int len) {
+
+    struct assoofs_dcache_entry *entry;
+
+    hash_for_each_possible_rcu(assoofs_dcache_names, entry, hash, assoofs_dcache_name_key(dir, name, len))
+        if(entry->dir == dir && entry->name_len == len && !memcmp(entry->name, name, len))
+            return entry;
+    return NULL;
+}
+
+/*
+* Devuelve 1 si el nombre esta en el directorio, 0 si seguro que no esta y -1 si el directorio no esta en la cache
+*/
+static int assoofs_dcache_lookup(struct super_block *sb, uint64_t dir_ino, const char *name, unsigned int len, uint64_t *inode_no) {
+
+    struct assoofs_dcache_dir *dir;
+    struct assoofs_dcache_entry *entry;
+    int ret = -1;
+
+    rcu_read_lock();
+    dir = assoofs_dcache_find_dir(sb, dir_ino);
+    if(dir) {
+        entry = assoofs_dcache_find_entry(dir, name, len);
+        ret = entry ? 1 : 0;
+        if(entry)
+            *inode_no = entry->inode_no;
+    }
+    rcu_read_unlock();
+    return ret;
+}
+
+static struct assoofs_dcache_entry *assoofs_dcache_new_entry(struct assoofs_dcache_dir *dir, const char *name, unsigned int len, uint64_t inode_no, umode_t mode) {
+
+    struct assoofs_dcache_entry *entry;
+
+    entry = kmalloc(sizeof(*entry) + len, GFP_NOFS);
+    if(!entry) return NULL;
+
+    entry->dir = dir;
+    entry->inode_no = inode_no;
+    entry->type = S_ISDIR(mode) ? DT_DIR : S_ISREG(mode) ? DT_REG : DT_UNKNOWN;
+    entry->name_len = len;
+    memcpy(entry->name, name, len);
+    return entry;
+}
+
+static void assoofs_dcache_free_dir(struct rcu_head *rcu) {
+
+    struct assoofs_dcache_dir *dir = container_of(rcu, struct assoofs_dcache_dir, rcu);
+    struct assoofs_dcache_entry *entry, *next;
+
+    list_for_each_entry_safe(entry, next, &dir->entries, sibling)
+        kfree(entry);
+    kfree(dir);
+}
+
+static void assoofs_dcache_put(struct assoofs_dcache_dir *dir) {
+    if(refcount_dec_and_test(&dir->ref))
+        call_rcu(&dir->rcu, assoofs_dcache_free_dir);
+}
+
+/*
+* Sacar un directorio de la cache, con assoofs_dcache_lock
+*/
+static void assoofs_dcache_drop_dir(struct assoofs_dcache_dir *dir) {
+
+    struct assoofs_dcache_entry *entry;
+
+    hash_del_rcu(&dir->hash);
+    list_for_each_entry(entry, &dir->entries, sibling)
+        hash_del_rcu(&entry->hash);
+    list_del(&dir->lru);
+    atomic_long_sub(dir->nr_entries, &assoofs_dcache_count);
+    assoofs_dcache_put(dir);
+}
+
+/*
+* Leer un directorio de disco y meterlo en la cache
+*/
+static void assoofs_dcache_fill(struct super_block *sb, struct assoofs_inode_info *dir_info) {
+
+    struct assoofs_super_block_info *afs_sb = sb->s_fs_info;
+    struct assoofs_dcache_dir *dir;
+    struct assoofs_dcache_entry *entry, *next;
+    struct assoofs_inode_info *store;
+    struct buffer_head *bh, *store_bh;
+    struct assoofs_dir_record_entry *record;
+    struct assoofs_compact_dir_entry *compact;
+    char *data;
+    umode_t mode;
+    uint64_t i, j;
+    unsigned long gen;
+
+    spin_lock(&assoofs_dcache_lock);
+    gen = assoofs_dcache_gen;
+    spin_unlock(&assoofs_dcache_lock);
+
+    dir = kmalloc(sizeof(*dir), GFP_NOFS);
+    if(!dir) return;
+
+    INIT_LIST_HEAD(&dir->entries);
+    dir->sb = sb;
+    dir->dir_ino = dir_info->inode_no;
+    dir->nr_entries = 0;
+    refcount_set(&dir->ref, 1);
+
+    if(assoofs_is_compact(sb)) {
+        bh = assoofs_compact_bread(sb, dir_info, &data);
+    } else {
+        bh = sb_bread(sb, dir_info->data_block_number);
+        data = bh ? bh->b_data : NULL;
+    }
+    store_bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER); //Para saber el tipo de cada hijo
+    if(!bh || !store_bh)
+        goto fail;
+
+    store = (struct assoofs_inode_info *)store_bh->b_data;
+    record = (struct assoofs_dir_record_entry *)data;
+    compact = (struct assoofs_compact_dir_entry *)data;
+
+    //Un inodo en memoria cuyo numero ya tiene otro objeto (unlink renumera) no puede llenar la tabla
+    for(j = 0; j < afs_sb->inodes_count; j++)
+        if(store[j].inode_no == dir_info->inode_no)
+            break;
+    if(j == afs_sb->inodes_count || !S_ISDIR(store[j].mode) || store[j].data_block_number != dir_info->data_block_number)
+        goto fail;
+
+    for(i = 0; i < dir_info->dir_children_count; i++) {
+        uint64_t inode_no = assoofs_is_compact(sb) ? compact[i].inode_no : record[i].inode_no;
+
+        mode = 0;
+        for(j = 0; j < afs_sb->inodes_count; j++)
+            if(store[j].inode_no == inode_no)
+                mode = store[j].mode;
+
+        if(assoofs_is_compact(sb))
+            entry = assoofs_dcache_new_entry(dir, data + compact[i].name_offset, compact[i].name_len, inode_no, mode);
+        else
+            entry = assoofs_dcache_new_entry(dir, record[i].filename, strlen(record[i].filename), inode_no, mode);
+        if(!entry)
+            goto fail;
+
+        list_add_tail(&entry->sibling, &dir->entries);
+        dir->nr_entries++;
+    }
+
+    brelse(store_bh);
+    brelse(bh);
+
+    spin_lock(&assoofs_dcache_lock);
+    //Otro lookup se adelanto, o el numero se reutilizo mientras se leia
+    if(gen != assoofs_dcache_gen || assoofs_dcache_find_dir(sb, dir->dir_ino)) {
+        spin_unlock(&assoofs_dcache_lock);
+        assoofs_dcache_free_dir(&dir->rcu);
+        return;
+    }
+    //Primero las entradas: no se ven hasta que el directorio esta publicado
+    list_for_each_entry(entry, &dir->entries, sibling)
+        hash_add_rcu(assoofs_dcache_names, &entry->hash, assoofs_dcache_name_key(dir, entry->name, entry->name_len));
+    hash_add_rcu(assoofs_dcache_dirs, &dir->hash, assoofs_dcache_dir_key(sb, dir->dir_ino));
+    list_add_tail(&dir->lru, &assoofs_dcache_lru);
+    atomic_long_add(dir->nr_entries, &assoofs_dcache_count);
+    spin_unlock(&assoofs_dcache_lock);
+    return;
+
+fail:
+    brelse(store_bh);
+    brelse(bh);
+    list_for_each_entry_safe(entry, next, &dir->entries, sibling)
+        kfree(entry);
+    kfree(dir);
+}
+
+/*
+* Mantener la cache al crear un objeto en un directorio
+*/
+static void assoofs_dcache_add(struct super_block *sb, uint64_t dir_ino, const char *name, uint64_t inode_no, umode_t mode) {
+
+    struct assoofs_dcache_dir *dir;
+    struct assoofs_dcache_entry *entry;
+    unsigned int len = strlen(name);
+
+    entry = assoofs_dcache_new_entry(NULL, name, len, inode_no, mode);
+
+    spin_lock(&assoofs_dcache_lock);
+    dir = assoofs_dcache_find_dir(sb, dir_ino);
+    if(!dir || !entry) {
+        if(dir)
+            assoofs_dcache_drop_dir(dir); //Sin la entrada la cache diria que el nombre no existe
+        spin_unlock(&assoofs_dcache_lock);
+        kfree(entry);
+        return;
+    }
+
+    entry->dir = dir;
+    list_add_tail(&entry->sibling, &dir->entries);
+    hash_add_rcu(assoofs_dcache_names, &entry->hash, assoofs_dcache_name_key(dir, name, len));
+    dir->nr_entries++;
+    atomic_long_inc(&assoofs_dcache_count);
+    spin_unlock(&assoofs_dcache_lock);
+}
+
+/*
+* Mantener la cache al borrar un nombre de un directorio
+*/
+static void assoofs_dcache_remove(struct super_block *sb, uint64_t dir_ino, const char *name) {
+
+    struct assoofs_dcache_dir *dir;
+    struct assoofs_dcache_entry *entry;
+
+    spin_lock(&assoofs_dcache_lock);
+    dir = assoofs_dcache_find_dir(sb, dir_ino);
+    entry = dir ? assoofs_dcache_find_entry(dir, name, strlen(name)) : NULL;
+    if(entry) {
+        hash_del_rcu(&entry->hash);
+        list_del(&entry->sibling);
+        dir->nr_entries--;
+        atomic_long_dec(&assoofs_dcache_count);
+        kfree_rcu(entry, rcu);
+    }
+    spin_unlock(&assoofs_dcache_lock);
+}
+
+/*
+* Listar un directorio desde la cache. Devuelve -1 si no se ha podido cargar en la cache.
+*/
+static int assoofs_dcache_iterate(struct super_block *sb, struct assoofs_inode_info *dir_info, struct dir_context *ctx, uint64_t *children) {
+
+    struct assoofs_dcache_dir *dir;
+    struct assoofs_dcache_entry *entry;
+
+    rcu_read_lock();
+    dir = assoofs_dcache_find_dir(sb, dir_info->inode_no);
+    if(!dir || !refcount_inc_not_zero(&dir->ref)) {
+        rcu_read_unlock();
+        assoofs_dcache_fill(sb, dir_info);
+        rcu_read_lock();
+        dir = assoofs_dcache_find_dir(sb, dir_info->inode_no);
+        if(!dir || !refcount_inc_not_zero(&dir->ref)) {
+            rcu_read_unlock();
+            return -1;
+        }
+    }
+    rcu_read_unlock();
+
+    //dir_emit puede dormir: la referencia mantiene vivo el directorio y el i_rwsem sus entradas
+    list_for_each_entry(entry, &dir->entries, sibling) {
+        dir_emit(ctx, entry->name, entry->name_len, entry->inode_no, entry->type);
+        ctx->pos += sizeof(struct assoofs_dir_record_entry);
+        *children |= assoofs_ino_bit(entry->inode_no);
+    }
+
+    assoofs_dcache_put(dir);
+    return 0;
+}
+
+/*
+* Olvidar la tabla de un numero de inodo que pasa a ser de otro objeto (unlink renumera y create
+* reutiliza numeros). Los llenados en curso ven el cambio de generacion y no publican.
+*/
+static void assoofs_dcache_forget(struct super_block *sb, uint64_t dir_ino) {
+
+    struct assoofs_dcache_dir *dir;
+
+    spin_lock(&assoofs_dcache_lock);
+    dir = assoofs_dcache_find_dir(sb, dir_ino);
+    if(dir)
+        assoofs_dcache_drop_dir(dir);
+    assoofs_dcache_gen++;
+    spin_unlock(&assoofs_dcache_lock);
+}
+
+/*
+* Olvidar todos los directorios de un superbloque (al desmontar)
+*/
+static void assoofs_dcache_drop_sb(struct super_block *sb) {
+
+    struct assoofs_dcache_dir *dir, *next;
+
+    spin_lock(&assoofs_dcache_lock);
+    list_for_each_entry_safe(dir, next, &assoofs_dcache_lru, lru)
+        if(!sb || dir->sb == sb)
+            assoofs_dcache_drop_dir(dir);
+    spin_unlock(&assoofs_dcache_lock);
+}
+
+static unsigned long assoofs_dcache_count_objects(struct shrinker *shrink, struct shrink_control *sc) {
+    return atomic_long_read(&assoofs_dcache_count);
+}
+
+/*
+* Con poca memoria se sueltan directorios enteros, empezando por los mas antiguos
+*/
+static unsigned long assoofs_dcache_scan_objects(struct shrinker *shrink, struct shrink_control *sc) {
+
+    struct assoofs_dcache_dir *dir;
+    unsigned long freed = 0;
+
+    spin_lock(&assoofs_dcache_lock);
+    while(freed < sc->nr_to_scan && !list_empty(&assoofs_dcache_lru)) {
+        dir = list_first_entry(&assoofs_dcache_lru, struct assoofs_dcache_dir, lru);
+        freed += dir->nr_entries + 1;
+        assoofs_dcache_drop_dir(dir);
+    }
+    spin_unlock(&assoofs_dcache_lock);
+    return freed;
+}
+
+static struct shrinker assoofs_dcache_shrinker = {
+    .count_objects = assoofs_dcache_count_objects,
+    .scan_objects = assoofs_dcache_scan_objects,
+    .seeks = DEFAULT_SEEKS,
+};
+
+/*
+ *  Copia en memoria del almacen de inodos
+ *
+ *  Se rellena al listar un directorio (con los inodos de sus hijos) y al buscar un inodo,
+ *  y se mantiene al dia en cada escritura del almacen.
+ */
+static uint64_t assoofs_ino_bit(uint64_t inode_no) {
+    return (inode_no >= 1 && inode_no <= ASSOOFS_ICACHE_SLOTS) ? 1ULL << (inode_no - 1) : 0;
+}
+
+static int assoofs_icache_get(struct super_block *sb, uint64_t inode_no, struct assoofs_inode_info *inode_info) {
+
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint64_t bit = assoofs_ino_bit(inode_no);
+    int found = 0;
+
+    spin_lock(&sbi->icache_lock);
+    if(sbi->icache_valid & bit) {
+        memcpy(inode_info, &sbi->icache[inode_no - 1], sizeof(*inode_info));
+        found = 1;
+    }
+    spin_unlock(&sbi->icache_lock);
+    return found;
+}
+
+static void assoofs_icache_store(struct super_block *sb, struct assoofs_inode_info *inode_info) {
+
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint64_t bit = assoofs_ino_bit(inode_info->inode_no);
+
+    if(!bit) return;
+
+    spin_lock(&sbi->icache_lock);
+    memcpy(&sbi->icache[inode_info->inode_no - 1], inode_info, sizeof(*inode_info));
+    sbi->icache_valid |= bit;
+    spin_unlock(&sbi->icache_lock);
+}
+
+/*
+* Cargar en memoria los inodos de la mascara que aun no esten, con una sola lectura del almacen
+*/
+static void assoofs_icache_prefetch(struct super_block *sb, uint64_t wanted) {
+
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_inode_info *store;
+    struct buffer_head *bh;
+    uint64_t i, bit;
+
+    if(!(wanted & ~READ_ONCE(sbi->icache_valid))) return;
+
+    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER); //Normalmente ya leido por el sb_breadahead
+    if(!bh) return;
+    store = (struct assoofs_inode_info *)bh->b_data;
+
+    //Se copia con el cerrojo cogido: una escritura del almacen a la vez acaba actualizando icache despues
+    spin_lock(&sbi->icache_lock);
+    wanted &= ~sbi->icache_valid;
+    for(i = 0; i < sbi->disk.inodes_count && wanted; i++) {
+        bit = assoofs_ino_bit(store[i].inode_no);
+        if(wanted & bit) {
+            memcpy(&sbi->icache[store[i].inode_no - 1], &store[i], sizeof(store[i]));
+            sbi->icache_valid |= bit;
+            wanted &= ~bit;
+        }
+    }
+    spin_unlock(&sbi->icache_lock);
+
+    brelse(bh);
+}
+
+/*
+ *  Resumen de uso de los directorios
+ *
+ *  Cada directorio guarda en su bloque lo que ocupa su subarbol. Cada cambio se suma a todos
+ *  los antecesores subiendo por los dentries; sin rename el padre de un dentry no cambia.
+ */
+static struct assoofs_dir_usage *assoofs_dir_usage_of(struct buffer_head *bh) {
+    return (struct assoofs_dir_usage *)((char *)assoofs_dir_bloom_of(bh) - sizeof(struct assoofs_dir_usage));
+}
+
+/*
+* Un fichero cuenta con un bloque si ya lo tiene o si tiene datos pendientes (bloque reservado)
+*/
+static uint64_t assoofs_usage_blocks(struct super_block *sb, struct assoofs_inode_info *inode_info) {
+
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint64_t ret;
+
+    if(inode_info->data_block_number != ASSOOFS_NO_BLOCK)
+        return 1;
+    if(!assoofs_ino_bit(inode_info->inode_no))
+        return 0;
+
+    mutex_lock(&sbi->delalloc_lock);
+    ret = sbi->pending[inode_info->inode_no - 1].data != NULL;
+    mutex_unlock(&sbi->delalloc_lock);
+    return ret;
+}
+
+static void assoofs_usage_charge(struct dentry *dentry, int64_t bytes, int64_t blocks, int64_t files, int64_t dirs) {
+
+    struct assoofs_inode_info *dir_info;
+    struct assoofs_dir_usage *usage;
+    struct buffer_head *bh;
+
+    if(!bytes && !blocks && !files && !dirs)
+        return;
+    if(d_unhashed(dentry)) //Borrado pero aun abierto: ya se desconto en unlink
+        return;
+
+    mutex_lock(&assoofs_usage_lock);
+    do {
+        dentry = dentry->d_parent;
+        dir_info = dentry->d_inode->i_private;
+
+        bh = sb_bread(dentry->d_sb, dir_info->data_block_number);
+        if(!bh) {
+            printk(KERN_ERR "El intento de leer el bloque numero [%llu] fallo. \n", dir_info->data_block_number);
+            break;
+        }
+        usage = assoofs_dir_usage_of(bh);
+        usage->bytes += bytes;
+        usage->blocks += blocks;
+        usage->files += files;
+        usage->dirs += dirs;
+        mark_buffer_dirty(bh);
+        sync_dirty_buffer(bh);
+        brelse(bh);
+    } while(!IS_ROOT(dentry));
+    mutex_unlock(&assoofs_usage_lock);
+}
+
+/*
+ *  Fechas
+ *
+ *  Se guardan en segundos en el registro del inodo. Un cambio que solo afecta a las fechas
+ *  (atime al leer, segun relatime) se apunta en icache y se escribe junto con la siguiente
+ *  actualizacion de cualquier inodo, al sincronizar, al desmontar o pasado un tiempo (lazytime).
+ */
+static void assoofs_info_to_times(struct inode *inode, struct assoofs_inode_info *inode_info) {
+
+    inode->i_atime.tv_sec = inode_info->atime;
+    inode->i_mtime.tv_sec = inode_info->mtime;
+    inode->i_ctime.tv_sec = inode_info->ctime;
+    inode->i_atime.tv_nsec = inode->i_mtime.tv_nsec = inode->i_ctime.tv_nsec = 0;
+}
+
+static void assoofs_times_to_info(struct inode *inode, struct assoofs_inode_info *inode_info) {
+
+    inode_info->atime = inode->i_atime.tv_sec;
+    inode_info->mtime = inode->i_mtime.tv_sec;
+    inode_info->ctime = inode->i_ctime.tv_sec;
+}
+
+static int assoofs_update_time(struct inode *inode, struct timespec64 *time, int flags) {
+
+    struct assoofs_inode_info *inode_info = inode->i_private;
+
+    if(flags & S_ATIME) inode->i_atime = *time;
+    if(flags & S_MTIME) inode->i_mtime = *time;
+    if(flags & S_CTIME) inode->i_ctime = *time;
+    assoofs_times_to_info(inode, inode_info);
+
+    //Solo cambian las fechas: se queda en memoria hasta la proxima escritura del almacen
+    assoofs_lazy_update(inode->i_sb, inode_info);
+    return 0;
+}
+
+/*
+* Apuntar en icache las fechas y el contador de accesos, para escribirlos mas tarde
+*/
+static void assoofs_lazy_update(struct super_block *sb, struct assoofs_inode_info *inode_info) {
+
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_inode_info *cached;
+    uint64_t bit = assoofs_ino_bit(inode_info->inode_no);
+
+    if(!bit) return;
+
+    spin_lock(&sbi->icache_lock);
+    cached = &sbi->icache[inode_info->inode_no - 1];
+    if(sbi->icache_valid & bit) {
+        cached->atime = inode_info->atime;
+        cached->mtime = inode_info->mtime;
+        cached->ctime = inode_info->ctime;
+        cached->access_count = inode_info->access_count;
+    } else {
+        memcpy(cached, inode_info, sizeof(*cached));
+        sbi->icache_valid |= bit;
+    }
+    sbi->lazy_dirty |= bit;
+    spin_unlock(&sbi->icache_lock);
+
+    schedule_delayed_work(&sbi->dirtytime_work, ASSOOFS_DIRTYTIME_DELAY);
+}
+
+/*
+* Pasar al almacen de inodos (ya leido y con assoofs_sb_lock cogido) las fechas y accesos pendientes
+*/
+static int assoofs_lazy_apply(struct super_block *sb, struct assoofs_inode_info *store) {
+
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_inode_info *cached;
+    uint64_t bit;
+    int i, n = 0;
+
+    spin_lock(&sbi->icache_lock);
+    for(i = 0; i < sbi->disk.inodes_count && sbi->lazy_dirty; i++) {
+        bit = assoofs_ino_bit(store[i].inode_no);
+        if(!(sbi->lazy_dirty & bit))
+            continue;
+
+        sbi->lazy_dirty &= ~bit;
+        if(!(sbi->icache_valid & bit))
+            continue;
+
+        cached = &sbi->icache[store[i].inode_no - 1];
+        store[i].atime = cached->atime;
+        store[i].mtime = cached->mtime;
+        store[i].ctime = cached->ctime;
+        store[i].access_count = cached->access_count;
+        n++;
+    }
+    spin_unlock(&sbi->icache_lock);
+    return n;
+}
+
+static void assoofs_lazy_flush(struct super_block *sb) {
+
+    struct buffer_head *bh;
+
+    if(!ASSOOFS_SB(sb)->lazy_dirty)
+        return;
+
+    //En solo lectura (imagenes compactas) los accesos se cuentan solo en memoria
+    if(sb_rdonly(sb)) {
+        spin_lock(&ASSOOFS_SB(sb)->icache_lock);
+        ASSOOFS_SB(sb)->lazy_dirty = 0;
+        spin_unlock(&ASSOOFS_SB(sb)->icache_lock);
+        return;
+    }
+
+    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+    if(!bh)
+        return;
+
+    mutex_lock(&assoofs_sb_lock);
+    if(assoofs_lazy_apply(sb, (struct assoofs_inode_info*)bh->b_data)) {
+        mark_buffer_dirty(bh);
+        sync_dirty_buffer(bh);
+    }
+    mutex_unlock(&assoofs_sb_lock);
+    brelse(bh);
+}
+
+static void assoofs_dirtytime_worker(struct work_struct *work) {
+
+    struct assoofs_sb_info *sbi = container_of(to_delayed_work(work), struct assoofs_sb_info, dirtytime_work);
+
+    assoofs_lazy_flush(sbi->sb);
+}
+
+/*
+ *  Datos calientes
+ *
+ *  Cada lectura suma uno al contador de accesos del inodo, que se escribe con las fechas.
+ *  Los ficheros con muchos accesos van a la zona caliente (los primeros bloques de datos,
+ *  junto al almacen de inodos y la raiz) al volcarse o al escribirse; los demas, fuera de ella.
+ */
+static uint64_t assoofs_hot_zone(void) {
+    return ((1ULL << ASSOOFS_HOT_BLOCKS) - 1) << (ASSOOFS_LAST_RESERVED_BLOCK + 1);
+}
+
+static int assoofs_is_hot(struct assoofs_inode_info *inode_info) {
+    return inode_info->access_count >= ASSOOFS_HOT_ACCESSES;
+}
+
+static void assoofs_heat_sample(struct super_block *sb, struct assoofs_inode_info *inode_info) {
+
+    if(inode_info->access_count == U32_MAX)
+        return;
+
+    inode_info->access_count++;
+    assoofs_lazy_update(sb, inode_info);
+}
+
+/*
+* Llevar a la zona caliente el bloque de un fichero caliente que se va a escribir
+*/
+static void assoofs_heat_place(struct super_block *sb, struct assoofs_inode_info *inode_info) {
+
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct buffer_head *old_bh, *new_bh;
+    uint64_t old_block = inode_info->data_block_number;
+    uint64_t new_block, zone;
+
+    if(!assoofs_is_hot(inode_info) || (assoofs_hot_zone() & (1ULL << old_block)))
+        return;
+
+    mutex_lock(&assoofs_sb_lock);
+    zone = assoofs_free_now(sb) & assoofs_hot_zone();
+    if(!zone || sbi->disk.block_refcount[old_block] || hweight64(assoofs_free_now(sb)) <= sbi->reserved_blocks) {
+        mutex_unlock(&assoofs_sb_lock);
+        return;
+    }
+    new_block = __ffs64(zone);
+    sbi->disk.free_blocks &= ~(1ULL << new_block);
+    sbi->discard_pending &= ~(1ULL << new_block);
+    assoofs_save_sb_info(sb);
+    mutex_unlock(&assoofs_sb_lock);
+
+    old_bh = sb_bread(sb, old_block);
+    if(!old_bh) {
+        assoofs_sb_release_block(sb, new_block);
+        return;
+    }
+
+    new_bh = sb_getblk(sb, new_block);
+    lock_buffer(new_bh);
+    memcpy(new_bh->b_data, old_bh->b_data, new_bh->b_size);
+    set_buffer_uptodate(new_bh);
+    unlock_buffer(new_bh);
+    mark_buffer_dirty(new_bh);
+    sync_dirty_buffer(new_bh);
+    brelse(new_bh);
+    brelse(old_bh);
+
+    inode_info->data_block_number = new_block;
+    assoofs_save_inode_info(sb, inode_info);
+    assoofs_sb_release_block(sb, old_block);
+
+    printk(KERN_INFO "Fichero caliente %llu movido del bloque %llu al %llu\n", inode_info->inode_no, old_block, new_block);
+}
+
+/*
+* debugfs: assoofs/<dispositivo>/heat, los ficheros de mas a menos accesos
+*/
+static int assoofs_heat_show(struct seq_file *m, void *v) {
+
+    struct super_block *sb = m->private;
+    struct assoofs_inode_info info;
+    uint64_t shown = 0, ino, best;
+    uint32_t best_count = 0;
+    int compact = assoofs_is_compact(sb);
+
+    assoofs_icache_prefetch(sb, ~0ULL);
+
+    //En una imagen compacta no hay bloques por fichero sino desplazamientos en bytes, ni zona caliente
+    if(compact)
+        seq_puts(m, "inodo desplazamiento accesos caliente\n");
+    else
+        seq_puts(m, "inodo bloque accesos caliente en_zona\n");
+    for(;;) {
+        best = 0;
+        for(ino = 1; ino <= ASSOOFS_ICACHE_SLOTS; ino++) {
+            if((shown & assoofs_ino_bit(ino)) || !assoofs_icache_get(sb, ino, &info) || !S_ISREG(info.mode))
+                continue;
+            if(!best || info.access_count > best_count) {
+                best = ino;
+                best_count = info.access_count;
+            }
+        }
+        if(!best || !assoofs_icache_get(sb, best, &info))
+            break;
+        shown |= assoofs_ino_bit(best);
+
+        if(compact) {
+            seq_printf(m, "%llu %llu %u %s\n", info.inode_no, info.data_byte_offset, info.access_count,
+                       assoofs_is_hot(&info) ? "si" : "no");
+            continue;
+        }
+        seq_printf(m, "%llu %llu %u %s %s\n", info.inode_no, info.data_block_number, info.access_count,
+                   assoofs_is_hot(&info) ? "si" : "no",
+                   (info.data_block_number < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED && (assoofs_hot_zone() & (1ULL << info.data_block_number))) ? "si" : "no");
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(assoofs_heat);
+
+/*
+ *  Asignacion retrasada
+ *
+ *  Lo que se escribe en un fichero sin bloque se queda en memoria con un bloque reservado
+ *  (el ENOSPC se da al escribir). Al volcar se asignan de una vez bloques seguidos para
+ *  todos los ficheros pendientes; un fichero que se borra antes nunca llega a pedir bloque.
+ */
+static int assoofs_delalloc_read(struct super_block *sb, struct assoofs_inode_info *inode_info, char __user *buf, size_t len, loff_t pos) {
+
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint64_t bit = assoofs_ino_bit(inode_info->inode_no);
+    char *data;
+    int ret = 0;
+
+    //La copia a usuario se hace sin el cerrojo (ver assoofs_delalloc_write)
+    data = kzalloc(len, GFP_KERNEL);
+    if(!data)
+        return -ENOMEM;
+
+    mutex_lock(&sbi->delalloc_lock);
+    if(inode_info->data_block_number != ASSOOFS_NO_BLOCK)
+        ret = 1; //Volcado mientras tanto, el llamador lee del bloque
+    else if(bit && sbi->pending[inode_info->inode_no - 1].data)
+        memcpy(data, sbi->pending[inode_info->inode_no - 1].data + pos, len);
+    //Si no, es un hueco y se queda a ceros
+    mutex_unlock(&sbi->delalloc_lock);
+
+    if(!ret && copy_to_user(buf, data, len))
+        ret = -EFAULT;
+
+    kfree(data);
+    return ret;
+}
+
+static int assoofs_delalloc_write(struct super_block *sb, struct assoofs_inode_info *inode_info, const char __user *buf, size_t len, loff_t pos, int *reserved) {
+
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_pending_inode *pending;
+    char *data, *fresh = NULL;
+    int ret = 0;
+
+    if(!assoofs_ino_bit(inode_info->inode_no) || pos + len > ASSOOFS_DEFAULT_BLOCK_SIZE)
+        return -EFBIG;
+
+    //Ni memoria ni copia de usuario con delalloc_lock cogido: el reclaim puede desalojar un inodo
+    //de assoofs con datos pendientes y assoofs_destroy_inode volcarlos, que vuelve a cogerlo
+    data = kmalloc(len, GFP_KERNEL);
+    if(!data)
+        return -ENOMEM;
+    if(copy_from_user(data, buf, len)) {
+        kfree(data);
+        return -EFAULT;
+    }
+
+    pending = &sbi->pending[inode_info->inode_no - 1];
+
+retry:
+    mutex_lock(&sbi->delalloc_lock);
+
+    if(inode_info->data_block_number != ASSOOFS_NO_BLOCK) {
+        ret = 1; //Volcado mientras tanto, el llamador escribe en el bloque
+        goto out;
+    }
+
+    if(!pending->data) {
+        if(!fresh) { //Primera escritura: el bloque en memoria se pide fuera del cerrojo
+            mutex_unlock(&sbi->delalloc_lock);
+            fresh = kzalloc(ASSOOFS_DEFAULT_BLOCK_SIZE, GFP_KERNEL);
+            if(!fresh) {
+                kfree(data);
+                return -ENOMEM;
+            }
+            goto retry;
+        }
+
+        //Se reserva el bloque ahora para poder dar ENOSPC en la escritura y no al volcar
+        mutex_lock(&assoofs_sb_lock);
+        if(hweight64(assoofs_free_now(sb)) <= sbi->reserved_blocks) {
+            mutex_unlock(&assoofs_sb_lock);
+            ret = -ENOSPC;
+            goto out;
+        }
+        sbi->reserved_blocks++;
+        mutex_unlock(&assoofs_sb_lock);
+
+        pending->data = fresh;
+        fresh = NULL;
+        pending->info = inode_info;
+        *reserved = 1;
+        schedule_delayed_work(&sbi->writeback_work, ASSOOFS_WRITEBACK_DELAY);
+    }
+
+    //Como en el bloque, el hueco desde el final del fichero se lee como ceros
+    if(pos > inode_info->file_size)
+        memset(pending->data + inode_info->file_size, 0, pos - inode_info->file_size);
+    memcpy(pending->data + pos, data, len);
+
+out:
+    mutex_unlock(&sbi->delalloc_lock);
+    kfree(fresh);
+    kfree(data);
+    return ret;
+}
+
+/*
+* Tirar los datos pendientes de un fichero que se borra, devolviendo su reserva
+*/
+static void assoofs_delalloc_drop(struct super_block *sb, uint64_t inode_no) {
+
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_pending_inode *pending;
+
+    if(!assoofs_ino_bit(inode_no)) return;
+
+    mutex_lock(&sbi->delalloc_lock);
+    pending = &sbi->pending[inode_no - 1];
+    if(pending->data) {
+        kfree(pending->data);
+        pending->data = NULL;
+        pending->info = NULL;
+
+        mutex_lock(&assoofs_sb_lock);
+        sbi->reserved_blocks--;
+        mutex_unlock(&assoofs_sb_lock);
+    }
+    mutex_unlock(&sbi->delalloc_lock);
+}
+
+/*
+* Primer tramo de n bloques libres seguidos, -1 si no hay
+*/
+static int assoofs_find_run(uint64_t free, int n) {
+
+    uint64_t run = (n == 64) ? ~0ULL : (1ULL << n) - 1;
+    int start;
+
+    for(start = 2; start + n <= ASSOOFS_MAX_BLOCKS; start++)
+        if(((free >> start) & run) == run)
+            return start;
+    return -1;
+}
+
+/*
+* Dar bloque a los ficheros pendientes de la mascara y escribir sus datos.
+* Los calientes van a la zona caliente; los demas a un tramo seguido fuera de ella si lo hay.
+*/
+static void assoofs_delalloc_flush(struct super_block *sb, uint64_t wanted) {
+
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_pending_inode *pending;
+    struct buffer_head *bh;
+    uint64_t blocks[ASSOOFS_ICACHE_SLOTS];
+    uint64_t free, taken, hot_zone = assoofs_hot_zone();
+    int i, n = 0, nhot = 0, start;
+
+    mutex_lock(&sbi->delalloc_lock);
+
+    for(i = 0; i < ASSOOFS_ICACHE_SLOTS; i++)
+        if((wanted & (1ULL << i)) && sbi->pending[i].data)
+            n++;
+    if(!n) {
+        mutex_unlock(&sbi->delalloc_lock);
+        return;
+    }
+
+    mutex_lock(&assoofs_sb_lock);
+    free = assoofs_free_now(sb) & ~3ULL; //Los bloques 0 y 1 nunca son de datos
+
+    //La reserva garantiza que hay un bloque libre para cada uno
+    for(i = 0; i < ASSOOFS_ICACHE_SLOTS; i++) {
+        pending = &sbi->pending[i];
+        if(!(wanted & (1ULL << i)) || !pending->data || !assoofs_is_hot(pending->info))
+            continue;
+        blocks[i] = __ffs64(free); //La zona caliente son los primeros bloques de datos
+        free &= ~(1ULL << blocks[i]);
+        nhot++;
+    }
+
+    start = assoofs_find_run(free & ~hot_zone, n - nhot);
+    if(start < 0)
+        start = assoofs_find_run(free, n - nhot);
+
+    for(i = 0; i < ASSOOFS_ICACHE_SLOTS; i++) {
+        pending = &sbi->pending[i];
+        if(!(wanted & (1ULL << i)) || !pending->data || assoofs_is_hot(pending->info))
+            continue;
+        if(start >= 0) {
+            blocks[i] = start++;
+        } else { //No hay tramo seguido: el primero libre, mejor fuera de la zona caliente
+            blocks[i] = __ffs64((free & ~hot_zone) ? (free & ~hot_zone) : free);
+        }
+        free &= ~(1ULL << blocks[i]);
+    }
+
+    taken = (assoofs_free_now(sb) & ~3ULL) & ~free;
+    sbi->disk.free_blocks &= ~taken;
+    sbi->discard_pending &= ~taken;
+    sbi->reserved_blocks -= n;
+    assoofs_save_sb_info(sb);
+    mutex_unlock(&assoofs_sb_lock);
+
+    for(i = 0; i < ASSOOFS_ICACHE_SLOTS; i++) {
+        pending = &sbi->pending[i];
+        if(!(wanted & (1ULL << i)) || !pending->data)
+            continue;
+
+        bh = sb_getblk(sb, blocks[i]);
+        lock_buffer(bh);
+        memcpy(bh->b_data, pending->data, bh->b_size);
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        mark_buffer_dirty(bh);
+        sync_dirty_buffer(bh);
+        brelse(bh);
+
+        pending->info->data_block_number = blocks[i];
+        assoofs_save_inode_info(sb, pending->info);
+
+        kfree(pending->data);
+        pending->data = NULL;
+        pending->info = NULL;
+    }
+
+    mutex_unlock(&sbi->delalloc_lock);
+    printk(KERN_INFO "%d ficheros volcados, %d de ellos calientes\n", n, nhot);
+}
+
+static void assoofs_writeback_worker(struct work_struct *work) {
 
-	record = (struct assoofs_dir_record_entry*)bh->b_data;
-	
-	for(i = 0; i<parent_info->dir_children_count;i++){ //Recorro el bucle tantas veces como archivos tenga
-		printk(KERN_INFO "Have file: '%s' (ino=%llu)\n", record->filename, record->inode_no);
-		if(!strcmp(record->filename, child_dentry->d_name.name)){ //Se compara el nombre con el del argumento (devuelve 0 si son iguales)
-			
-			//Se guarda en memoria la información del inodo
-			inode = assoofs_get_inode(sb, record->inode_no);
-			
-			inode_init_owner(inode, parent_inode, ((struct assoofs_inode_info*)inode->i_private)->mode);
-			d_add(child_dentry, inode); //Para construir el arbol de inodos
-			return NULL;
-		}
-		
-		printk(KERN_ERR "No se encontro inodo para el nombre [%s]\n", child_dentry->d_name.name);
-		record++;
-	}
-	
-    brelse(bh);
-    return NULL;
+    struct assoofs_sb_info *sbi = container_of(to_delayed_work(work), struct assoofs_sb_info, writeback_work);
+
+    assoofs_delalloc_flush(sbi->sb, ~0ULL);
+}
+
+static int assoofs_fsync(struct file *filp, loff_t start, loff_t end, int datasync) {
+
+    struct inode *inode = file_inode(filp);
+
+    assoofs_delalloc_flush(inode->i_sb, assoofs_ino_bit(inode->i_ino));
+    assoofs_lazy_flush(inode->i_sb); //Las fechas y accesos retrasados tambien tienen que llegar a disco
+    return 0;
 }
 
 /*
@@ -356,12 +2069,27 @@ int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block){
    
     assoofs_sb = sb->s_fs_info;
 
+    //Los bloques reservados para datos pendientes no se pueden dar a otro
+    if(hweight64(assoofs_free_now(sb)) <= ASSOOFS_SB(sb)->reserved_blocks){
+        mutex_unlock(&assoofs_sb_lock);
+        printk(KERN_ERR "Error: No hay bloques libres");
+        return -1;
+    }
+
+    //Se prefiere un bloque fuera de la zona caliente, que queda para los ficheros calientes
     for(i = 2; i<ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++)
-        if(assoofs_sb->free_blocks & (1<<i)){
+        if((assoofs_free_now(sb) & ~assoofs_hot_zone()) & (1ULL<<i)){
             printk(KERN_INFO "El bloque numero %d esta libre", i);
             break;
         }
 
+    if(i>= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED) //Si no queda ninguno fuera, cualquiera libre
+        for(i = 2; i<ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++)
+            if(assoofs_free_now(sb) & (1ULL<<i)){
+                printk(KERN_INFO "El bloque numero %d esta libre", i);
+                break;
+            }
+
     if(i>= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED){
         mutex_unlock(&assoofs_sb_lock);
         printk(KERN_ERR "Error: No hay bloques libres");
@@ -370,7 +2098,8 @@ int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block){
 
     *block = i;
 
-    assoofs_sb->free_blocks |= (1 << i); //Marco el lugar como 0 en el mapa de bits
+    assoofs_sb->free_blocks &= ~(1ULL << i); //Marco el lugar como 0 en el mapa de bits
+    ASSOOFS_SB(sb)->discard_pending &= ~(1ULL << i); //Se va a escribir, ya no hay que descartarlo
     assoofs_save_sb_info(sb);
 
     printk(KERN_INFO "Bloque libre obtenido correctamente");
@@ -379,17 +2108,187 @@ int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block){
     return 0;
 }
 
+/*
+* Obtener un bloque libre y dejarlo a ceros en disco
+*/
+int assoofs_alloc_zeroed_block(struct super_block *sb, uint64_t *block){
+
+    struct buffer_head *bh;
+
+    if(assoofs_sb_get_a_freeblock(sb, block))
+        return -1;
+
+    bh = sb_getblk(sb, *block); //No hace falta leerlo, se sobreescribe entero
+    lock_buffer(bh);
+    memset(bh->b_data, 0, bh->b_size);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+
+    mark_buffer_dirty(bh);
+    sync_dirty_buffer(bh);
+    brelse(bh);
+    return 0;
+}
+
+/*
+* Devolver un bloque al mapa de bits de bloques libres
+*/
+void assoofs_sb_release_block(struct super_block *sb, uint64_t block){
+
+    struct assoofs_super_block_info *assoofs_sb;
+
+    if(block == ASSOOFS_NO_BLOCK) return; //Ficheros con hueco, no tienen bloque que liberar
+
+    mutex_lock(&assoofs_sb_lock);
+
+    assoofs_sb = sb->s_fs_info;
+    if(assoofs_sb->block_refcount[block] > 0) {
+        assoofs_sb->block_refcount[block]--; //Otro fichero clonado sigue usando el bloque
+    } else {
+        assoofs_sb->free_blocks |= (1ULL << block); //Marco el lugar como 1 en el mapa de bits
+
+        //Los descartes se juntan y se mandan mas tarde, no en cada borrado
+        if(ASSOOFS_SB(sb)->mount_opts & ASSOOFS_MOUNT_DISCARD) {
+            ASSOOFS_SB(sb)->discard_pending |= (1ULL << block);
+            schedule_delayed_work(&ASSOOFS_SB(sb)->discard_work, ASSOOFS_DISCARD_DELAY);
+        }
+    }
+    assoofs_save_sb_info(sb);
+
+    mutex_unlock(&assoofs_sb_lock);
+}
+
+/*
+* Bloques que se pueden dar ya: libres y sin un descarte en curso. Con assoofs_sb_lock.
+*/
+static uint64_t assoofs_free_now(struct super_block *sb) {
+    return ASSOOFS_SB(sb)->disk.free_blocks & ~ASSOOFS_SB(sb)->discard_busy;
+}
+
+/*
+* Apartar para descartarlos los bloques libres de la mascara, con assoofs_sb_lock. Se dejan fuera
+* los que hagan falta para cumplir las reservas de datos pendientes. Devuelve los apartados.
+*/
+static uint64_t assoofs_discard_begin(struct super_block *sb, uint64_t mask) {
+
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint64_t busy = assoofs_free_now(sb) & mask;
+
+    while(busy && hweight64(assoofs_free_now(sb) & ~busy) < sbi->reserved_blocks)
+        busy &= ~(1ULL << __ffs64(busy));
+
+    sbi->discard_busy |= busy;
+    return busy;
+}
+
+/*
+* Devolver los bloques apartados una vez descartados
+*/
+static void assoofs_discard_end(struct super_block *sb, uint64_t blocks) {
+
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+
+    mutex_lock(&assoofs_sb_lock);
+    sbi->discard_busy &= ~blocks;
+    sbi->discard_pending &= ~blocks;
+    mutex_unlock(&assoofs_sb_lock);
+}
+
+/*
+* Descartar en el dispositivo los tramos seguidos de bloques de la mascara que midan al menos minlen.
+* Se llama sin assoofs_sb_lock, con los bloques apartados por assoofs_discard_begin.
+*/
+static uint64_t assoofs_discard_runs(struct super_block *sb, uint64_t blocks, uint64_t minlen) {
+
+    uint64_t start, len, discarded = 0;
+    int i = 0;
+
+    while(i < ASSOOFS_MAX_BLOCKS) {
+        if(!(blocks & (1ULL << i))) {
+            i++;
+            continue;
+        }
+
+        start = i;
+        while(i < ASSOOFS_MAX_BLOCKS && (blocks & (1ULL << i)))
+            i++;
+        len = i - start;
+
+        if(len >= minlen && !sb_issue_discard(sb, start, len, GFP_NOFS, 0))
+            discarded += len;
+    }
+    return discarded;
+}
+
+static void assoofs_discard_worker(struct work_struct *work) {
+
+    struct assoofs_sb_info *sbi = container_of(to_delayed_work(work), struct assoofs_sb_info, discard_work);
+    uint64_t blocks, discarded;
+
+    //Los que no se aparten por las reservas siguen pendientes para el siguiente descarte
+    mutex_lock(&assoofs_sb_lock);
+    blocks = assoofs_discard_begin(sbi->sb, sbi->discard_pending);
+    mutex_unlock(&assoofs_sb_lock);
+
+    discarded = assoofs_discard_runs(sbi->sb, blocks, 1);
+    assoofs_discard_end(sbi->sb, blocks);
+
+    printk(KERN_INFO "%llu bloques liberados descartados\n", discarded);
+}
+
+/*
+* Copia al escribir: si el bloque del fichero es compartido, se le da una copia propia
+*/
+int assoofs_unshare_block(struct super_block *sb, struct assoofs_inode_info *inode_info){
+
+    struct assoofs_super_block_info *assoofs_sb;
+    struct buffer_head *old_bh;
+    struct buffer_head *new_bh;
+    uint64_t new_block;
+
+    assoofs_sb = sb->s_fs_info;
+
+    if(inode_info->data_block_number == ASSOOFS_NO_BLOCK || assoofs_sb->block_refcount[inode_info->data_block_number] == 0)
+        return 0;
+
+    if(assoofs_sb_get_a_freeblock(sb, &new_block))
+        return -1;
+
+    old_bh = sb_bread(sb, inode_info->data_block_number);
+    if(!old_bh) {
+        assoofs_sb_release_block(sb, new_block);
+        return -1;
+    }
+
+    new_bh = sb_getblk(sb, new_block);
+    lock_buffer(new_bh);
+    memcpy(new_bh->b_data, old_bh->b_data, new_bh->b_size);
+    set_buffer_uptodate(new_bh);
+    unlock_buffer(new_bh);
+    mark_buffer_dirty(new_bh);
+    sync_dirty_buffer(new_bh);
+    brelse(new_bh);
+    brelse(old_bh);
+
+    assoofs_sb_release_block(sb, inode_info->data_block_number); //Solo quita una referencia
+    inode_info->data_block_number = new_block;
+    assoofs_save_inode_info(sb, inode_info);
+
+    printk(KERN_INFO "Bloque compartido copiado al bloque %llu", new_block);
+    return 0;
+}
+
 /*
 * Guardar informacion del superbloque en disco para que persista
 */
 void assoofs_save_sb_info(struct super_block *vsb){
 
     struct buffer_head *bh;
-    struct assoofs_super_block *sb; 
+    struct assoofs_super_block_info *sb; 
 
     sb = vsb->s_fs_info; //Informacion persistente
     bh = sb_bread(vsb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
-    bh->b_data = (char*)sb; //Se sobreescriben los datos con nuevos datos
+    memcpy(bh->b_data, sb, sizeof(*sb)); //Se sobreescriben los datos con nuevos datos
 
     //Grabar en disco y liberar
     mark_buffer_dirty(bh);
@@ -428,6 +2327,7 @@ void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *i
     //Se busca el final del almacen de inodos y se copia en él el argumoento inode
     inode_info += assoofs_sb->inodes_count;
     memcpy(inode_info, inode, sizeof(struct assoofs_inode_info));
+    assoofs_icache_store(sb, inode);
 
     assoofs_sb->inodes_count++;
     assoofs_save_sb_info(sb);
@@ -469,6 +2369,8 @@ int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *i
     }
 
     memcpy(inode_pos, inode_info, sizeof(*inode_pos)); //Se copia en el inodo buscado (inode_pos) la informacion del inodo actualizada
+    assoofs_icache_store(sb, inode_info);
+    assoofs_lazy_apply(sb, (struct assoofs_inode_info*)bh->b_data); //Las fechas pendientes de otros inodos van en la misma escritura
     mark_buffer_dirty(bh);
     sync_dirty_buffer(bh);
     brelse(bh);
@@ -521,6 +2423,7 @@ static int assoofs_create_object(struct inode *dir , struct dentry *dentry, umod
 
     struct assoofs_inode_info *parent_inode_info;
     struct assoofs_dir_record_entry *dir_contents;
+    struct assoofs_dir_bloom *bloom;
 
     uint64_t count;
 
@@ -537,6 +2440,14 @@ static int assoofs_create_object(struct inode *dir , struct dentry *dentry, umod
         mutex_unlock(&assoofs_directory_children_update_lock);
         return -1;
     }
+
+    parent_inode_info = (struct assoofs_inode_info *) dir->i_private;
+
+    if(parent_inode_info->dir_children_count >= ASSOOFS_DIR_MAX_CHILDREN){
+        printk(KERN_ERR "Error: el directorio ya tiene el numero máximo de entradas (%zu)", ASSOOFS_DIR_MAX_CHILDREN);
+        mutex_unlock(&assoofs_directory_children_update_lock);
+        return -ENOSPC;
+    }
     
     nodo = new_inode(sb); //Se crea el nuevo inodo
 
@@ -549,6 +2460,8 @@ static int assoofs_create_object(struct inode *dir , struct dentry *dentry, umod
     inode_info = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);
     inode_info->inode_no = nodo->i_ino; 
     inode_info->mode = mode;
+    inode_info->access_count = 0;
+    assoofs_times_to_info(nodo, inode_info);
 
     if(S_ISDIR(mode)){ //Si es un directorio
         printk(KERN_INFO "New directory request\n");
@@ -564,10 +2477,34 @@ static int assoofs_create_object(struct inode *dir , struct dentry *dentry, umod
 
     printk(KERN_INFO "inodo creado.");
 
-    assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number); //Tomar el primer bloque libre
+    //Un fichero no recibe bloque hasta que se vuelcan sus datos (asignacion retrasada)
+    inode_info->data_block_number = ASSOOFS_NO_BLOCK;
+    if(S_ISDIR(mode) && assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number)){ //Tomar el primer bloque libre
+        printk(KERN_ERR "Error: no quedan bloques libres para el directorio\n");
+        iput(nodo); //assoofs_destroy_inode libera inode_info
+        mutex_unlock(&assoofs_directory_children_update_lock);
+        return -ENOSPC;
+    }
+
+    if(S_ISDIR(mode)){ //El bloque puede tener restos de otro directorio, su filtro y su resumen empiezan vacios
+        bh = sb_bread(sb, inode_info->data_block_number);
+        if(!bh){
+            printk(KERN_ERR "Error: no se pudo leer el bloque del nuevo directorio\n");
+            assoofs_sb_release_block(sb, inode_info->data_block_number);
+            iput(nodo);
+            mutex_unlock(&assoofs_directory_children_update_lock);
+            return -EIO;
+        }
+        assoofs_dir_bloom_rebuild(assoofs_dir_bloom_of(bh), NULL, 0);
+        memset(assoofs_dir_usage_of(bh), 0, sizeof(struct assoofs_dir_usage));
+        mark_buffer_dirty(bh);
+        sync_dirty_buffer(bh);
+        brelse(bh);
+    }
+
     assoofs_add_inode_info(sb, inode_info); //Informacion persistente de nodo a disco
+    assoofs_dcache_forget(sb, inode_info->inode_no); //El numero puede venir de un objeto borrado
 
-    parent_inode_info = (struct assoofs_inode_info *) dir->i_private;
     bh = sb_bread(sb, parent_inode_info->data_block_number); //Se lee el contenido en disco donde esta el dir padre
 
     dir_contents = (struct assoofs_dir_record_entry*)bh->b_data;
@@ -576,6 +2513,9 @@ static int assoofs_create_object(struct inode *dir , struct dentry *dentry, umod
 
     strcpy(dir_contents->filename, dentry->d_name.name);
 
+    bloom = assoofs_dir_bloom_of(bh);
+    assoofs_dir_bloom_add(bloom, dir_contents->filename);
+
     //Escribir en disco
     mark_buffer_dirty(bh);
     sync_dirty_buffer(bh);
@@ -589,13 +2529,21 @@ static int assoofs_create_object(struct inode *dir , struct dentry *dentry, umod
 		return -1;
 	}
     parent_inode_info->dir_children_count++;
+    dir->i_mtime = dir->i_ctime = current_time(dir);
+    assoofs_times_to_info(dir, parent_inode_info);
     assoofs_save_inode_info(sb, parent_inode_info); //Pasar informacion a disco
+    assoofs_dcache_add(sb, parent_inode_info->inode_no, dentry->d_name.name, inode_info->inode_no, mode);
 
     mutex_unlock(&assoofs_inodes_lock);
-	mutex_unlock(&assoofs_directory_children_update_lock);
+
+    if(S_ISDIR(mode))
+        assoofs_usage_charge(dentry, 0, 1, 0, 1);
+    else
+        assoofs_usage_charge(dentry, 0, 0, 1, 0); //El bloque se cuenta al reservarlo en la primera escritura
+    mutex_unlock(&assoofs_directory_children_update_lock);
 
     inode_init_owner(nodo, dir, mode);
-    d_add(dentry, nodo);
+    d_instantiate(dentry, nodo); //El dentry puede ser uno negativo que ya esta en la cache
 
     printk(KERN_INFO "Inodo creado y añadido correctamente");
 
@@ -604,7 +2552,13 @@ static int assoofs_create_object(struct inode *dir , struct dentry *dentry, umod
 
 void assoofs_destroy_inode(struct inode *inode) {
 
-    struct assoofs_inode *inode_info = inode->i_private;
+    struct assoofs_inode_info *inode_info = inode->i_private;
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(inode->i_sb);
+    uint64_t bit = assoofs_ino_bit(inode->i_ino);
+
+    //Si sus datos siguen en memoria se vuelcan ahora, luego ya no habra a quien apuntarles el bloque
+    if(bit && sbi->pending[inode->i_ino - 1].info == inode_info)
+        assoofs_delalloc_flush(inode->i_sb, bit);
 
     printk(KERN_INFO "Eliminando datos privados del nodo %p ( %lu)\n", inode_info, inode->i_ino);
     kmem_cache_free(assoofs_inode_cache, inode_info);
@@ -614,10 +2568,136 @@ void assoofs_destroy_inode(struct inode *inode) {
 /*
  *  Operaciones sobre el superbloque
  */
+/*
+* Al desmontar se libera lo que se tenia en memoria del superbloque
+*/
+static void assoofs_put_super(struct super_block *sb) {
+
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+
+    cancel_work_sync(&sbi->preload_work); //Antes de tirar la cache que esta llenando
+    debugfs_remove_recursive(sbi->debugfs_dir);
+    assoofs_dcache_drop_sb(sb);
+    cancel_delayed_work_sync(&sbi->writeback_work);
+    assoofs_delalloc_flush(sb, ~0ULL);
+    cancel_delayed_work_sync(&sbi->dirtytime_work);
+    assoofs_lazy_flush(sb);
+    flush_delayed_work(&sbi->discard_work); //Los descartes pendientes se mandan ya
+
+    sb->s_fs_info = NULL;
+    kfree(sbi);
+}
+
+static int assoofs_show_options(struct seq_file *seq, struct dentry *root) {
+
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(root->d_sb);
+
+    if(sbi->mount_opts & ASSOOFS_MOUNT_DISCARD)
+        seq_puts(seq, ",discard");
+    if(sbi->preload == ASSOOFS_PRELOAD_ROOT)
+        seq_puts(seq, ",preload=root");
+    else if(sbi->preload == ASSOOFS_PRELOAD_ALL)
+        seq_puts(seq, ",preload=all");
+    return 0;
+}
+
+static int assoofs_sync_fs(struct super_block *sb, int wait) {
+    assoofs_delalloc_flush(sb, ~0ULL);
+    assoofs_lazy_flush(sb);
+    return 0;
+}
+
+static int assoofs_remount(struct super_block *sb, int *flags, char *data);
+
 static const struct super_operations assoofs_sops = {
     .destroy_inode = assoofs_destroy_inode,
+    .put_super = assoofs_put_super,
+    .sync_fs = assoofs_sync_fs,
+    .remount_fs = assoofs_remount,
+    .show_options = assoofs_show_options,
+};
+
+/*
+ *  Opciones de montaje
+ */
+enum { Opt_discard, Opt_nodiscard, Opt_preload_none, Opt_preload_root, Opt_preload_all, Opt_err };
+
+static const match_table_t assoofs_tokens = {
+    {Opt_discard, "discard"},
+    {Opt_nodiscard, "nodiscard"},
+    {Opt_preload_none, "preload=none"},
+    {Opt_preload_root, "preload=root"},
+    {Opt_preload_all, "preload=all"},
+    {Opt_err, NULL},
 };
 
+static int assoofs_parse_options(struct super_block *sb, char *options) {
+
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    substring_t args[MAX_OPT_ARGS];
+    char *p;
+
+    if(!options) return 0;
+
+    while((p = strsep(&options, ",")) != NULL) {
+        if(!*p) continue;
+
+        switch(match_token(p, assoofs_tokens, args)) {
+        case Opt_discard:
+            sbi->mount_opts |= ASSOOFS_MOUNT_DISCARD;
+            break;
+        case Opt_nodiscard:
+            sbi->mount_opts &= ~ASSOOFS_MOUNT_DISCARD;
+            break;
+        case Opt_preload_none:
+            sbi->preload = ASSOOFS_PRELOAD_NONE;
+            break;
+        case Opt_preload_root:
+            sbi->preload = ASSOOFS_PRELOAD_ROOT;
+            break;
+        case Opt_preload_all:
+            sbi->preload = ASSOOFS_PRELOAD_ALL;
+            break;
+        default:
+            printk(KERN_ERR "assoofs: opcion de montaje desconocida \"%s\"\n", p);
+            return -EINVAL;
+        }
+    }
+
+    if((sbi->mount_opts & ASSOOFS_MOUNT_DISCARD) && !blk_queue_discard(bdev_get_queue(sb->s_bdev))) {
+        printk(KERN_WARNING "assoofs: el dispositivo no admite discard, se ignora la opcion\n");
+        sbi->mount_opts &= ~ASSOOFS_MOUNT_DISCARD;
+    }
+    return 0;
+}
+
+/*
+* Remontar: se vuelven a leer las opciones; una imagen compacta nunca pasa a escritura
+*/
+static int assoofs_remount(struct super_block *sb, int *flags, char *data) {
+
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    unsigned long mount_opts = sbi->mount_opts;
+    int preload = sbi->preload;
+
+    if(assoofs_is_compact(sb) && !(*flags & SB_RDONLY)) {
+        printk(KERN_ERR "assoofs: una imagen compacta solo se puede montar en solo lectura\n");
+        return -EROFS;
+    }
+
+    if(assoofs_parse_options(sb, data)) {
+        sbi->mount_opts = mount_opts;
+        sbi->preload = preload;
+        return -EINVAL;
+    }
+
+    sync_filesystem(sb); //Datos y fechas pendientes a disco antes de un posible paso a solo lectura
+
+    if(sbi->preload != ASSOOFS_PRELOAD_NONE && sbi->preload != preload)
+        schedule_work(&sbi->preload_work);
+    return 0;
+}
+
 
 /*
  *  Obtener informacion persistente del inodo
@@ -630,13 +2710,33 @@ struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64
 
     struct assoofs_super_block_info *afs_sb = sb->s_fs_info;
     struct assoofs_inode_info *buffer = NULL;
+    struct assoofs_inode_info cached;
 
     int i;
 
+    //Si ya esta en memoria (por ejemplo, se listo su directorio) no hace falta leer el almacen
+    if(assoofs_icache_get(sb, inode_no, &cached)) {
+        buffer = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);
+        if(buffer)
+            memcpy(buffer, &cached, sizeof(*buffer));
+        return buffer;
+    }
+
     //Se lee el bloque con el almacen de inodos
     bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
     inode_info = (struct assoofs_inode_info*)bh->b_data;
 
+    //En una imagen compacta el almacen esta ordenado y no cambia, no hace falta recorrerlo
+    if(assoofs_is_compact(sb)) {
+        if(inode_no >= 1 && inode_no <= afs_sb->inodes_count && inode_info[inode_no-1].inode_no == inode_no) {
+            buffer = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL);
+            memcpy(buffer, &inode_info[inode_no-1], sizeof(*buffer));
+            assoofs_icache_store(sb, buffer);
+        }
+        brelse(bh);
+        return buffer;
+    }
+
     if (mutex_lock_interruptible(&assoofs_inodes_lock)) {
 		printk(KERN_ERR "No se pudo bloquear el mutex\n");
 		return NULL;
@@ -648,6 +2748,7 @@ struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64
 
             buffer = kmem_cache_alloc(assoofs_inode_cache, GFP_KERNEL); //Se asigna memoria al buffer 
             memcpy(buffer, inode_info, sizeof(*buffer)); //Se copia el contenido de inode_info en buffer
+            assoofs_icache_store(sb, buffer);
             break;
         }
         inode_info++; //Pasa a apuntar al siguiente elemento
@@ -658,6 +2759,79 @@ struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64
     return buffer;
 }
 
+/*
+* Precarga de metadatos (preload=root|all): el almacen de inodos entero pasa a icache y los
+* bloques de los directorios se piden todos de una vez antes de llenar su cache de nombres
+*/
+static int assoofs_preload_read_inode(struct super_block *sb, uint64_t inode_no, struct assoofs_inode_info *inode_info) {
+
+    struct assoofs_inode_info *store, search;
+    struct buffer_head *bh;
+    int ret = -ENOENT;
+
+    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
+    if(!bh)
+        return -EIO;
+
+    store = (struct assoofs_inode_info *)bh->b_data;
+    search.inode_no = inode_no;
+    store = assoofs_search_inode_info(sb, store, &search);
+    if(store && store - (struct assoofs_inode_info *)bh->b_data < ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count) {
+        memcpy(inode_info, store, sizeof(*inode_info));
+        ret = 0;
+    }
+
+    brelse(bh);
+    return ret;
+}
+
+static void assoofs_preload_worker(struct work_struct *work) {
+
+    struct assoofs_sb_info *sbi = container_of(work, struct assoofs_sb_info, preload_work);
+    struct super_block *sb = sbi->sb;
+    struct assoofs_inode_info dir_info;
+    struct blk_plug plug;
+    uint64_t dirs = 0, ino;
+    bool found;
+
+    assoofs_icache_prefetch(sb, ~0ULL);
+
+    for(ino = ASSOOFS_ROOTDIR_INODE_NUMBER; ino <= ASSOOFS_ICACHE_SLOTS; ino++) {
+        if(sbi->preload == ASSOOFS_PRELOAD_ROOT && ino != ASSOOFS_ROOTDIR_INODE_NUMBER)
+            break;
+        if(assoofs_icache_get(sb, ino, &dir_info) && S_ISDIR(dir_info.mode))
+            dirs |= assoofs_ino_bit(ino);
+    }
+
+    //Todas las lecturas en cola a la vez para que el dispositivo las junte
+    blk_start_plug(&plug);
+    for(ino = ASSOOFS_ROOTDIR_INODE_NUMBER; ino <= ASSOOFS_ICACHE_SLOTS; ino++) {
+        if(!(dirs & assoofs_ino_bit(ino)) || !assoofs_icache_get(sb, ino, &dir_info))
+            continue;
+        if(assoofs_is_compact(sb))
+            sb_breadahead(sb, dir_info.data_byte_offset / ASSOOFS_DEFAULT_BLOCK_SIZE);
+        else
+            sb_breadahead(sb, dir_info.data_block_number);
+    }
+    blk_finish_plug(&plug);
+
+    //Con el cerrojo de create/unlink el numero de hijos no cambia mientras se lee el directorio;
+    //el inodo se lee del almacen ya dentro del cerrojo, la copia de antes puede estar vieja
+    for(ino = ASSOOFS_ROOTDIR_INODE_NUMBER; ino <= ASSOOFS_ICACHE_SLOTS; ino++) {
+        if(!(dirs & assoofs_ino_bit(ino)))
+            continue;
+        mutex_lock(&assoofs_directory_children_update_lock);
+        rcu_read_lock();
+        found = assoofs_dcache_find_dir(sb, ino) != NULL; //Un lookup ya lo cargo
+        rcu_read_unlock();
+        if(!found && !assoofs_preload_read_inode(sb, ino, &dir_info) && S_ISDIR(dir_info.mode))
+            assoofs_dcache_fill(sb, &dir_info);
+        mutex_unlock(&assoofs_directory_children_update_lock);
+    }
+
+    printk(KERN_INFO "assoofs: precarga terminada (%d directorios)\n", hweight64(dirs));
+}
+
 /*
  *  Inicialización del superbloque
  */
@@ -670,6 +2844,7 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
 
     struct buffer_head *bh;
     struct assoofs_super_block_info *assoofs_sb;
+    struct assoofs_sb_info *sbi;
     struct inode *root_inode;
     
     printk(KERN_INFO "assoofs_fill_super request\n");
@@ -684,10 +2859,46 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
         return -1;
     }
 
+    //Las imagenes anteriores tienen registros de inodo mas cortos, sin fechas
+    if(assoofs_sb->version != ASSOOFS_VERSION) {
+        printk(KERN_ERR "assoofs: version de imagen %llu no soportada, hay que crearla de nuevo con mkassoofs\n", assoofs_sb->version);
+        brelse(bh);
+        return -EINVAL;
+    }
+
+    //Las imagenes compactas no tienen espacio libre ni huecos en los directorios: solo lectura
+    if(assoofs_sb->flags & ASSOOFS_SB_FLAG_COMPACT) {
+        printk(KERN_INFO "assoofs: imagen compacta, se monta en solo lectura\n");
+        sb->s_flags |= SB_RDONLY;
+    }
+
     //3
+    sbi = kzalloc(sizeof(*sbi), GFP_KERNEL); //Copia en memoria, el bh se suelta al final
+    if(!sbi) {
+        brelse(bh);
+        return -ENOMEM;
+    }
+    memcpy(&sbi->disk, assoofs_sb, sizeof(sbi->disk));
+    sbi->sb = sb;
+    INIT_DELAYED_WORK(&sbi->discard_work, assoofs_discard_worker);
+    spin_lock_init(&sbi->icache_lock);
+    mutex_init(&sbi->delalloc_lock);
+    INIT_DELAYED_WORK(&sbi->writeback_work, assoofs_writeback_worker);
+    INIT_DELAYED_WORK(&sbi->dirtytime_work, assoofs_dirtytime_worker);
+    INIT_WORK(&sbi->preload_work, assoofs_preload_worker);
+
     sb->s_magic = ASSOOFS_MAGIC; //Se asigna el numero magico
-	sb->s_fs_info = assoofs_sb; //Contenido del superbloque
+	sb->s_fs_info = &sbi->disk; //Contenido del superbloque
+
+    if(assoofs_parse_options(sb, data)) {
+        sb->s_fs_info = NULL;
+        kfree(sbi);
+        brelse(bh);
+        return -EINVAL;
+    }
+
     sb->s_maxbytes = ASSOOFS_DEFAULT_BLOCK_SIZE; //Se asigna el tamaño de bloque
+    sb->s_time_gran = NSEC_PER_SEC; //En disco las fechas se guardan en segundos
     sb->s_op = &assoofs_sops; //Se asignan las operaciones
 
     //4
@@ -698,11 +2909,18 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent) {
     root_inode->i_sb = sb; //Se asigna un puntero al superbloque
     root_inode->i_op = &assoofs_inode_ops; //Se asignan operaciones de inodo
     root_inode->i_fop = &assoofs_dir_operations; //Se asginan operaciones de directorio
-    root_inode->i_atime = root_inode->i_mtime = root_inode->i_ctime = current_time(root_inode); //Se le asignan las fechas (acceso, modificacion y creacion)
 
     root_inode->i_private = assoofs_get_inode_info(sb, ASSOOFS_ROOTDIR_INODE_NUMBER); //La informacion persistente VER ERROR
+    assoofs_info_to_times(root_inode, root_inode->i_private); //Se le asignan las fechas guardadas
 
     sb->s_root = d_make_root(root_inode); //Lo marco como nodo raiz
+
+    sbi->debugfs_dir = debugfs_create_dir(sb->s_id, assoofs_debugfs_root);
+    debugfs_create_file("heat", 0444, sbi->debugfs_dir, sb, &assoofs_heat_fops);
+
+    //La precarga sigue en segundo plano, el montaje no la espera
+    if(sbi->preload != ASSOOFS_PRELOAD_NONE)
+        schedule_work(&sbi->preload_work);
 	
     brelse(bh); //Se libera la memoria de bh
     return 0;
@@ -746,6 +2964,11 @@ static int __init assoofs_init(void) {
 
     assoofs_inode_cache = kmem_cache_create("assoofs_inode_cache", sizeof(struct assoofs_inode_info), 0, (SLAB_RECLAIM_ACCOUNT|SLAB_MEM_SPREAD), NULL);
 
+    if(register_shrinker(&assoofs_dcache_shrinker))
+        printk(KERN_ERR "No se pudo registrar el shrinker de la cache de directorios");
+
+    assoofs_debugfs_root = debugfs_create_dir("assoofs", NULL);
+
     if(ret == 0)
         printk(KERN_INFO "assoofs registrado correctamente");
     else
@@ -759,6 +2982,10 @@ static void __exit assoofs_exit(void) {
     int ret;
     printk(KERN_INFO "assoofs_exit request\n");
 
+    unregister_shrinker(&assoofs_dcache_shrinker);
+    debugfs_remove_recursive(assoofs_debugfs_root);
+    assoofs_dcache_drop_sb(NULL);
+    rcu_barrier(); //Esperar a que se liberen los directorios soltados
     kmem_cache_destroy(assoofs_inode_cache);
 
     ret = unregister_filesystem(&assoofs_type);
@@ -1,8 +1,15 @@
 #define ASSOOFS_MAGIC 0x20200406
+#define ASSOOFS_VERSION 3 /* 2: el registro de inodo guarda las fechas; 3: resumen de uso en los directorios */
 #define ASSOOFS_DEFAULT_BLOCK_SIZE 4096
 #define ASSOOFS_FILENAME_MAXLEN 255
 #define ASSOOFS_LAST_RESERVED_BLOCK ASSOOFS_ROOTDIR_BLOCK_NUMBER
 #define ASSOOFS_LAST_RESERVED_INODE ASSOOFS_ROOTDIR_INODE_NUMBER
+#define ASSOOFS_NO_BLOCK 0 /* data_block_number de un fichero sin bloque asignado (hueco) */
+#define ASSOOFS_MAX_BLOCKS 64 /* bloques que cubre el mapa de bits free_blocks */
+#define ASSOOFS_SB_FLAG_COMPACT 0x1 /* imagen compacta de solo lectura (mkassoofs -c) */
+#define ASSOOFS_DIR_BLOOM_MAGIC 0x424c4f4f4d415353ULL
+#define ASSOOFS_DIR_BLOOM_BYTES 96
+#define ASSOOFS_DIR_BLOOM_HASHES 3
 const int ASSOOFS_SUPERBLOCK_BLOCK_NUMBER = 0;
 const int ASSOOFS_INODESTORE_BLOCK_NUMBER = 1;
 const int ASSOOFS_ROOTDIR_BLOCK_NUMBER = 2;
@@ -15,7 +22,9 @@ struct assoofs_super_block_info {
     uint64_t block_size;    
     uint64_t inodes_count;
     uint64_t free_blocks;
-    char padding[4056];
+    uint8_t block_refcount[ASSOOFS_MAX_BLOCKS]; /* referencias extra a cada bloque (ficheros clonados) */
+    uint64_t flags;
+    char padding[3984];
 };
 
 struct assoofs_dir_record_entry {
@@ -23,12 +32,117 @@ struct assoofs_dir_record_entry {
     uint64_t inode_no;
 };
 
+/* Filtro de Bloom con los nombres del directorio, al final de su bloque de datos */
+struct assoofs_dir_bloom {
+    uint64_t magic;
+    uint8_t bits[ASSOOFS_DIR_BLOOM_BYTES];
+};
+
+/* Lo que ocupa el subarbol de un directorio, sin contar su propio bloque; va justo antes del filtro */
+struct assoofs_dir_usage {
+    uint64_t bytes;  /* suma de los tamaños de los ficheros */
+    uint64_t blocks; /* bloques de datos de ficheros y subdirectorios (uno clonado cuenta en cada fichero) */
+    uint64_t files;
+    uint64_t dirs;
+};
+
+#define ASSOOFS_DIR_MAX_CHILDREN ((ASSOOFS_DEFAULT_BLOCK_SIZE - sizeof(struct assoofs_dir_bloom) - sizeof(struct assoofs_dir_usage)) / sizeof(struct assoofs_dir_record_entry))
+
+static inline uint32_t assoofs_dir_bloom_hash(const char *name, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed; /* FNV-1a */
+
+    while (*name) {
+        h ^= (uint8_t)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static inline uint32_t assoofs_dir_bloom_bit(const char *name, int i) {
+    uint32_t h1 = assoofs_dir_bloom_hash(name, 0);
+    uint32_t h2 = assoofs_dir_bloom_hash(name, 0x9e3779b9u) | 1;
+
+    return (h1 + i * h2) % (ASSOOFS_DIR_BLOOM_BYTES * 8);
+}
+
+static inline void assoofs_dir_bloom_add(struct assoofs_dir_bloom *bloom, const char *name) {
+    uint32_t bit;
+    int i;
+
+    for (i = 0; i < ASSOOFS_DIR_BLOOM_HASHES; i++) {
+        bit = assoofs_dir_bloom_bit(name, i);
+        bloom->bits[bit / 8] |= 1 << (bit % 8);
+    }
+}
+
+static inline int assoofs_dir_bloom_may_contain(const struct assoofs_dir_bloom *bloom, const char *name) {
+    uint32_t bit;
+    int i;
+
+    for (i = 0; i < ASSOOFS_DIR_BLOOM_HASHES; i++) {
+        bit = assoofs_dir_bloom_bit(name, i);
+        if (!(bloom->bits[bit / 8] & (1 << (bit % 8))))
+            return 0;
+    }
+    return 1;
+}
+
 struct assoofs_inode_info {
     mode_t mode;
+    uint32_t access_count; /* lecturas del fichero, para separar datos calientes y frios */
     uint64_t inode_no;
-    uint64_t data_block_number;
+    union {
+        uint64_t data_block_number;
+        uint64_t data_byte_offset; /* imagenes compactas: los datos pueden empezar en mitad de un bloque */
+    };
     union {
         uint64_t file_size;
         uint64_t dir_children_count;
     };
+    uint64_t atime; /* fechas de acceso, modificacion y cambio, en segundos */
+    uint64_t mtime;
+    uint64_t ctime;
 };
+
+/*
+ * Imagenes compactas: el almacen de inodos esta ordenado (el inodo n en la posicion n-1) y
+ * los datos de un directorio son dir_children_count entradas ordenadas por nombre seguidas
+ * de los nombres, sin '\0'. Ni los datos de un fichero ni los de un directorio cruzan un bloque.
+ */
+struct assoofs_compact_dir_entry {
+    uint32_t inode_no;
+    uint16_t name_offset; /* desde el principio de los datos del directorio */
+    uint16_t name_len;
+};
+
+/*
+ * ASSOOFS_IOC_BULKSTAT: copia en buffer hasta count registros del almacen de inodos empezando
+ * en la posicion cursor. Al volver count dice cuantos se copiaron y cursor donde seguir;
+ * se ha terminado cuando count vuelve a 0.
+ */
+struct assoofs_bulkstat {
+    uint64_t inode_no;
+    uint64_t mode;
+    uint64_t size;  /* ficheros: bytes; directorios: numero de entradas */
+    uint64_t block; /* bloque de datos, ASSOOFS_NO_BLOCK si no tiene; en imagenes compactas, posicion en bytes */
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+};
+
+struct assoofs_bulkstat_req {
+    uint64_t cursor;
+    uint64_t count;
+    uint64_t buffer; /* struct assoofs_bulkstat[count] en espacio de usuario */
+};
+
+#define ASSOOFS_IOC_BULKSTAT _IOWR('A', 1, struct assoofs_bulkstat_req)
+#define ASSOOFS_IOC_GETUSAGE _IOR('A', 2, struct assoofs_dir_usage) /* sobre un directorio */
+
+static inline int assoofs_compact_name_cmp(const char *a, size_t a_len, const char *b, size_t b_len) {
+    int ret = memcmp(a, b, a_len < b_len ? a_len : b_len);
+
+    if (ret)
+        return ret;
+    return (a_len > b_len) - (a_len < b_len);
+}
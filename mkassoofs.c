@@ -6,6 +6,9 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
 #include "assoofs.h"
 
 #define WELCOMEFILE_DATABLOCK_NUMBER (ASSOOFS_LAST_RESERVED_BLOCK + 1)
@@ -13,7 +16,7 @@
 
 static int write_superblock(int fd) {
     struct assoofs_super_block_info sb = {
-        .version = 1,
+        .version = ASSOOFS_VERSION,
         .magic = ASSOOFS_MAGIC,
         .block_size = ASSOOFS_DEFAULT_BLOCK_SIZE,
         .inodes_count = WELCOMEFILE_INODE_NUMBER,
@@ -34,9 +37,10 @@ static int write_superblock(int fd) {
 static int write_root_inode(int fd) {
     ssize_t ret;
 
-    struct assoofs_inode_info root_inode;
+    struct assoofs_inode_info root_inode = {0};
 
     root_inode.mode = S_IFDIR;
+    root_inode.atime = root_inode.mtime = root_inode.ctime = time(NULL);
     root_inode.inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER;
     root_inode.data_block_number = ASSOOFS_ROOTDIR_BLOCK_NUMBER;
     root_inode.dir_children_count = 1;
@@ -74,8 +78,11 @@ static int write_welcome_inode(int fd, const struct assoofs_inode_info *i) {
     return 0;
 }
 
-int write_dirent(int fd, const struct assoofs_dir_record_entry *record) {
+int write_dirent(int fd, const struct assoofs_dir_record_entry *record, const struct assoofs_dir_usage *usage) {
     ssize_t nbytes = sizeof(*record), ret;
+    struct assoofs_dir_bloom bloom = {
+        .magic = ASSOOFS_DIR_BLOOM_MAGIC,
+    };
 
     ret = write(fd, record, nbytes);
     if (ret != nbytes) {
@@ -84,13 +91,27 @@ int write_dirent(int fd, const struct assoofs_dir_record_entry *record) {
     }
     printf("root directory datablocks (name+inode_no pair for welcomefile) written succesfully.\n");
 
-    nbytes = ASSOOFS_DEFAULT_BLOCK_SIZE - sizeof(*record);
+    nbytes = ASSOOFS_DEFAULT_BLOCK_SIZE - sizeof(*record) - sizeof(*usage) - sizeof(bloom);
     ret = lseek(fd, nbytes, SEEK_CUR);
     if (ret == (off_t)-1) {
         printf("Writing the padding for rootdirectory children datablock has failed.\n");
         return -1;
     }
     printf("Padding after the rootdirectory children written succesfully.\n");
+
+    ret = write(fd, usage, sizeof(*usage));
+    if (ret != sizeof(*usage)) {
+        printf("Writing the rootdirectory usage summary has failed.\n");
+        return -1;
+    }
+
+    assoofs_dir_bloom_add(&bloom, record->filename);
+    ret = write(fd, &bloom, sizeof(bloom));
+    if (ret != sizeof(bloom)) {
+        printf("Writing the rootdirectory name filter has failed.\n");
+        return -1;
+    }
+    printf("root directory name filter written succesfully.\n");
     return 0;
 }
 
@@ -106,6 +127,304 @@ int write_block(int fd, char *block, size_t len) {
     return 0;
 }
 
+/*
+ * Imagen compacta de solo lectura (mkassoofs -c <directorio> [-o <orden>] <device>)
+ */
+struct compact_node {
+    char path[PATH_MAX];     /* ruta en el directorio de origen */
+    const char *rel;         /* ruta relativa a la raiz de la imagen */
+    char name[ASSOOFS_FILENAME_MAXLEN];
+    mode_t mode;
+    int parent;
+    char *data;              /* contenido del fichero o datos del directorio */
+    uint64_t size;
+    uint64_t children;
+    uint64_t offset;         /* posicion en bytes dentro de la imagen */
+    int placed;
+    time_t atime, mtime, ctime;
+};
+
+static struct compact_node *compact_nodes;
+static int compact_count;
+
+static int compact_cmp_nodes(const void *a, const void *b) {
+    const struct compact_node *x = &compact_nodes[*(const int *)a];
+    const struct compact_node *y = &compact_nodes[*(const int *)b];
+
+    return assoofs_compact_name_cmp(x->name, strlen(x->name), y->name, strlen(y->name));
+}
+
+/*
+ * Recorre el arbol en anchura: el numero de inodo de cada objeto es su posicion + 1
+ */
+static int compact_scan(const char *src) {
+    char path[PATH_MAX + ASSOOFS_FILENAME_MAXLEN + 1];
+    struct compact_node *node;
+    struct dirent *de;
+    struct stat st;
+    DIR *dir;
+    int q;
+
+    compact_nodes = calloc(ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED, sizeof(*compact_nodes));
+    if (!compact_nodes) {
+        perror("calloc");
+        return -1;
+    }
+
+    node = &compact_nodes[compact_count++];
+    snprintf(node->path, sizeof(node->path), "%s", src);
+    node->rel = node->path + strlen(node->path);
+    node->mode = S_IFDIR | 0755;
+    node->parent = -1;
+    if (stat(src, &st)) {
+        perror(src);
+        return -1;
+    }
+    node->atime = st.st_atime;
+    node->mtime = st.st_mtime;
+    node->ctime = st.st_ctime;
+
+    for (q = 0; q < compact_count; q++) {
+        if (!S_ISDIR(compact_nodes[q].mode))
+            continue;
+
+        dir = opendir(compact_nodes[q].path);
+        if (!dir) {
+            perror(compact_nodes[q].path);
+            return -1;
+        }
+
+        while ((de = readdir(dir)) != NULL) {
+            if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                continue;
+
+            if (compact_count >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED) {
+                printf("The source tree has more than %d objects.\n", ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED);
+                closedir(dir);
+                return -1;
+            }
+            if (strlen(de->d_name) >= ASSOOFS_FILENAME_MAXLEN) {
+                printf("The name %s is too long.\n", de->d_name);
+                closedir(dir);
+                return -1;
+            }
+
+            node = &compact_nodes[compact_count];
+            if (snprintf(path, sizeof(path), "%s/%s", compact_nodes[q].path, de->d_name) >= (int)sizeof(node->path)) {
+                printf("The path %s is too long.\n", path);
+                closedir(dir);
+                return -1;
+            }
+            strcpy(node->path, path);
+            if (lstat(node->path, &st)) {
+                perror(node->path);
+                closedir(dir);
+                return -1;
+            }
+            if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+                printf("Skipping %s: only regular files and directories are supported.\n", node->path);
+                continue;
+            }
+
+            strcpy(node->name, de->d_name);
+            node->rel = node->path + strlen(src) + 1;
+            node->mode = st.st_mode & (S_IFMT | 07777);
+            node->parent = q;
+            node->size = S_ISREG(st.st_mode) ? st.st_size : 0;
+            node->atime = st.st_atime;
+            node->mtime = st.st_mtime;
+            node->ctime = st.st_ctime;
+            compact_count++;
+        }
+        closedir(dir);
+    }
+    return 0;
+}
+
+static int compact_load_file(struct compact_node *node) {
+    int fd;
+
+    if (node->size > ASSOOFS_DEFAULT_BLOCK_SIZE) {
+        printf("%s does not fit in a single block.\n", node->path);
+        return -1;
+    }
+
+    node->data = malloc(node->size + 1);
+    fd = open(node->path, O_RDONLY);
+    if (!node->data || fd == -1 || read(fd, node->data, node->size) != (ssize_t)node->size) {
+        perror(node->path);
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * Datos de un directorio: entradas ordenadas por nombre y despues los nombres
+ */
+static int compact_build_dir(int index) {
+    struct compact_node *node = &compact_nodes[index];
+    struct assoofs_compact_dir_entry *entry;
+    uint64_t count = 0, names = 0, pos, j;
+    int *children;
+    int i;
+
+    children = calloc(compact_count, sizeof(*children));
+    if (!children) {
+        perror("calloc");
+        return -1;
+    }
+
+    for (i = 0; i < compact_count; i++) {
+        if (compact_nodes[i].parent == index) {
+            children[count++] = i;
+            names += strlen(compact_nodes[i].name);
+        }
+    }
+    qsort(children, count, sizeof(children[0]), compact_cmp_nodes);
+
+    node->children = count;
+    node->size = count * sizeof(*entry) + names;
+    if (node->size > ASSOOFS_DEFAULT_BLOCK_SIZE) {
+        printf("The directory %s does not fit in a single block.\n", node->path);
+        free(children);
+        return -1;
+    }
+
+    node->data = calloc(1, node->size + 1);
+    if (!node->data) {
+        perror("calloc");
+        free(children);
+        return -1;
+    }
+
+    entry = (struct assoofs_compact_dir_entry *)node->data;
+    pos = count * sizeof(*entry);
+    for (j = 0; j < count; j++, entry++) {
+        entry->inode_no = children[j] + 1;
+        entry->name_offset = pos;
+        entry->name_len = strlen(compact_nodes[children[j]].name);
+        memcpy(node->data + pos, compact_nodes[children[j]].name, entry->name_len);
+        pos += entry->name_len;
+    }
+
+    free(children);
+    return 0;
+}
+
+/*
+ * Coloca los datos uno detras de otro (varios objetos pequeños comparten bloque),
+ * empezando por la raiz, los que aparecen en el fichero de orden y el resto en anchura.
+ * Un directorio siempre va antes que su contenido, porque se lee antes.
+ */
+static void compact_place(struct compact_node *node, uint64_t *cursor) {
+    if (node->placed)
+        return;
+    if (node->parent >= 0)
+        compact_place(&compact_nodes[node->parent], cursor);
+    node->placed = 1;
+    if (node->size == 0)
+        return;
+
+    if (*cursor % ASSOOFS_DEFAULT_BLOCK_SIZE + node->size > ASSOOFS_DEFAULT_BLOCK_SIZE)
+        *cursor += ASSOOFS_DEFAULT_BLOCK_SIZE - *cursor % ASSOOFS_DEFAULT_BLOCK_SIZE;
+    node->offset = *cursor;
+    *cursor += node->size;
+}
+
+static int compact_layout(const char *order, uint64_t *cursor) {
+    char line[PATH_MAX];
+    const char *rel;
+    FILE *f;
+    int i;
+
+    *cursor = (ASSOOFS_INODESTORE_BLOCK_NUMBER + 1) * ASSOOFS_DEFAULT_BLOCK_SIZE;
+    compact_place(&compact_nodes[0], cursor);
+
+    if (order) {
+        f = fopen(order, "r");
+        if (!f) {
+            perror(order);
+            return -1;
+        }
+        while (fgets(line, sizeof(line), f)) {
+            line[strcspn(line, "\n")] = '\0';
+            for (rel = line; *rel == '.' && rel[1] == '/'; rel += 2)
+                ;
+            while (*rel == '/')
+                rel++;
+            for (i = 1; i < compact_count; i++)
+                if (!strcmp(compact_nodes[i].rel, rel))
+                    compact_place(&compact_nodes[i], cursor);
+        }
+        fclose(f);
+    }
+
+    for (i = 1; i < compact_count; i++)
+        compact_place(&compact_nodes[i], cursor);
+    return 0;
+}
+
+static int write_compact_image(int fd, const char *src, const char *order) {
+    struct assoofs_super_block_info *sb;
+    struct assoofs_inode_info *inode;
+    uint64_t cursor, image_size;
+    char *image;
+    int i;
+
+    if (compact_scan(src))
+        return -1;
+
+    for (i = 0; i < compact_count; i++) {
+        if (S_ISDIR(compact_nodes[i].mode) ? compact_build_dir(i) : compact_load_file(&compact_nodes[i]))
+            return -1;
+    }
+
+    if (compact_layout(order, &cursor))
+        return -1;
+
+    image_size = (cursor + ASSOOFS_DEFAULT_BLOCK_SIZE - 1) / ASSOOFS_DEFAULT_BLOCK_SIZE * ASSOOFS_DEFAULT_BLOCK_SIZE;
+    image = calloc(1, image_size);
+    if (!image) {
+        perror("calloc");
+        return -1;
+    }
+
+    sb = (struct assoofs_super_block_info *)image;
+    sb->version = ASSOOFS_VERSION;
+    sb->magic = ASSOOFS_MAGIC;
+    sb->block_size = ASSOOFS_DEFAULT_BLOCK_SIZE;
+    sb->inodes_count = compact_count;
+    sb->free_blocks = 0;
+    sb->flags = ASSOOFS_SB_FLAG_COMPACT;
+
+    inode = (struct assoofs_inode_info *)(image + ASSOOFS_INODESTORE_BLOCK_NUMBER * ASSOOFS_DEFAULT_BLOCK_SIZE);
+    for (i = 0; i < compact_count; i++, inode++) {
+        inode->mode = compact_nodes[i].mode;
+        inode->inode_no = i + 1;
+        inode->data_byte_offset = compact_nodes[i].offset;
+        if (S_ISDIR(compact_nodes[i].mode))
+            inode->dir_children_count = compact_nodes[i].children;
+        else
+            inode->file_size = compact_nodes[i].size;
+        inode->atime = compact_nodes[i].atime;
+        inode->mtime = compact_nodes[i].mtime;
+        inode->ctime = compact_nodes[i].ctime;
+        memcpy(image + compact_nodes[i].offset, compact_nodes[i].data, compact_nodes[i].size);
+    }
+
+    if (write_block(fd, image, image_size)) {
+        free(image);
+        return -1;
+    }
+
+    printf("Compact image with %d objects written succesfully (%llu bytes).\n", compact_count, (unsigned long long)image_size);
+    free(image);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     int fd;
@@ -124,17 +443,49 @@ int main(int argc, char *argv[])
         .inode_no = WELCOMEFILE_INODE_NUMBER,
     };
 
-    if (argc != 2) {
+    struct assoofs_dir_usage root_usage = {
+        .bytes = sizeof(welcomefile_body),
+        .blocks = 1,
+        .files = 1,
+    };
+
+    const char *compact_src = NULL;
+    const char *compact_order = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:o:")) != -1) {
+        switch (opt) {
+        case 'c':
+            compact_src = optarg;
+            break;
+        case 'o':
+            compact_order = optarg;
+            break;
+        default:
+            optind = argc + 1;
+        }
+    }
+
+    if (optind != argc - 1 || (compact_order && !compact_src)) {
         printf("Usage: mkassoofs <device>\n");
+        printf("       mkassoofs -c <source_dir> [-o <access_order_file>] <device>\n");
         return -1;
     }
 
-    fd = open(argv[1], O_RDWR);
+    fd = open(argv[optind], O_RDWR);
     if (fd == -1) {
         perror("Error opening the device");
         return -1;
     }
 
+    if (compact_src) {
+        ret = write_compact_image(fd, compact_src, compact_order) ? 1 : 0;
+        close(fd);
+        return ret;
+    }
+
+    welcome.atime = welcome.mtime = welcome.ctime = time(NULL);
+
     ret = 1;
     do {
         if (write_superblock(fd))
@@ -146,7 +497,7 @@ int main(int argc, char *argv[])
         if (write_welcome_inode(fd, &welcome))
             break;
 
-        if (write_dirent(fd, &record))
+        if (write_dirent(fd, &record, &root_usage))
             break;
         
         if (write_block(fd, welcomefile_body, welcome.file_size))